@@ -0,0 +1,303 @@
+// Kernel microbenchmarks on synthetic particle layouts
+// Usage: mpm-bench [max_particles] [repetitions] [workers]
+// Each kernel is timed on 10k, 100k and 1M particles (up to max_particles) in three layouts;
+// the best of the repetitions is reported as particle throughput and as bandwidth over the
+// particle fields the kernel reads or writes (grid traffic is not counted)
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <random>
+#include <functional>
+
+#include "Simulator.h"
+
+typedef std::chrono::steady_clock Clock;
+
+enum Layout
+{
+	UNIFORM,	// One cube at the snow particle spacing
+	CLUSTERED,	// Gaussian clumps, dense centres and sparse tails
+	SHEET,		// A slab two cells thick; sparse in blocks, dense in the cells it covers
+	LAYOUT_COUNT
+};
+
+static const char* layout_names[LAYOUT_COUNT] = { "uniform", "clustered", "sheet" };
+
+// Particle field bytes touched by each kernel, each field counted once
+static const size_t
+R = sizeof(Real), V = sizeof(Vector3r), M = sizeof(Matrix3r), W = sizeof(SplineWeights);
+
+struct Kernel
+{
+	const char* name;
+	size_t bytes;
+	double best;
+};
+
+enum KernelId
+{
+	K_MASS,
+	K_VELOCITIES,
+	K_FUSED,
+	K_FORCES,
+	K_AFFINE,
+	K_GATHER,
+	K_PLASTICITY,
+	K_HESSIAN,
+	KERNEL_COUNT
+};
+
+static Kernel kernel_table[KERNEL_COUNT] = {
+	{ "initializeMass",        2 * V + 2 * W + R, 0 },
+	{ "initializeVelocities",  2 * V + W + R + V + M, 0 },
+	{ "particleToGrid",        2 * V + 2 * W + R + V + M, 0 },
+	{ "explicitVelocities",    V + 2 * W + M, 0 },
+	{ "updateAffineState",     2 * V + W + M, 0 },
+	{ "updateVelocities",      V + 2 * W + V + M + R, 0 },
+	{ "applyPlasticity",       4 * M + 2 * R + 3 * R + 2 * M + V + M, 0 },
+	{ "deltaEnergyDerivative", 5 * M + V + 4 * R, 0 },
+};
+
+// Clamp a position into the grid interior, away from the collision band
+static Eigen::Vector3d clampToDomain(Eigen::Vector3d p)
+{
+	const double margin = 0.05;
+	double size[3] = { WIN_METERS_X, WIN_METERS_Y, WIN_METERS_Z };
+	for (int d = 0; d < 3; d++)
+	{
+		p[d] = std::min(std::max(p[d], margin), size[d] - margin);
+	}
+	return p;
+}
+
+static PointCloud* generate(Layout layout, int count, std::mt19937& rng)
+{
+	std::uniform_real_distribution<double> unit(0, 1), velocity(-1, 1);
+	std::normal_distribution<double> normal(0, 1);
+
+	double particle_volume = PARTICLE_DIAM * PARTICLE_DIAM * PARTICLE_DIAM,
+		   particle_mass = particle_volume * DENSITY,
+		   side = cbrt(count * particle_volume);
+	Eigen::Vector3d center(WIN_METERS_X / 2.0, WIN_METERS_Y / 2.0, WIN_METERS_Z / 2.0);
+
+	// Clump centres and the slab extent only depend on the layout
+	Eigen::Vector3d clumps[16];
+	for (int c = 0; c < 16; c++)
+	{
+		clumps[c] = center + 0.35 * Eigen::Vector3d(velocity(rng), velocity(rng), velocity(rng));
+	}
+	double thickness = 2.0 * WIN_METERS_Y / GRID_RES_Y,
+		   extent = std::min(sqrt(count * particle_volume / thickness), (double)WIN_METERS_Z - 0.1);
+
+	PointCloud* cloud = new PointCloud(count);
+	for (int i = 0; i < count; i++)
+	{
+		Eigen::Vector3d pos;
+		switch (layout)
+		{
+		case UNIFORM:
+			pos = center + side * Eigen::Vector3d(unit(rng) - 0.5, unit(rng) - 0.5, unit(rng) - 0.5);
+			break;
+		case CLUSTERED:
+			pos = clumps[rng() % 16] + side / 8 * Eigen::Vector3d(normal(rng), normal(rng), normal(rng));
+			break;
+		default:
+			pos = center + Eigen::Vector3d(extent * (unit(rng) - 0.5), thickness * (unit(rng) - 0.5), extent * (unit(rng) - 0.5));
+			break;
+		}
+
+		Eigen::Vector3d vel(velocity(rng), velocity(rng), velocity(rng));
+		cloud->particles.push_back(Particle(clampToDomain(pos), vel, particle_mass));
+
+		// Some elastic deformation, so the plasticity kernels clamp and rotate
+		Matrix3r& fe = cloud->particles.def_elastic[i];
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				fe(r, c) += (Real)(0.02 * velocity(rng));
+			}
+		}
+	}
+	cloud->max_velocity = 3;
+	cloud->max_wave_speed = 0;
+
+	return cloud;
+}
+
+// Time one call and keep the best
+static void measure(KernelId id, const std::function<void()>& func)
+{
+	Clock::time_point start = Clock::now();
+	func();
+	double t = std::chrono::duration<double>(Clock::now() - start).count();
+	if (kernel_table[id].best == 0 || t < kernel_table[id].best)
+	{
+		kernel_table[id].best = t;
+	}
+}
+
+static void benchmark(Layout layout, int count, int repetitions, ThreadPool* pool)
+{
+	std::mt19937 rng(7);
+	PointCloud* cloud = generate(layout, count, rng);
+	cloud->thread_pool = pool;
+
+	Grid* grid = new Grid(SimulationConfig(), cloud);
+	grid->thread_pool = pool;
+
+	cloud->sortParticles(grid->origin, grid->cellsize);
+	grid->initializeMass();
+	grid->calculateVolumes();
+
+	ParticleArrays& p = cloud->particles;
+	const double dt = 1e-5;
+	Vector3a gravity = GRAVITY.cast<Accum>();
+	int batches = (count + PARTICLE_LANES - 1) / PARTICLE_LANES;
+	AlignedVector<Matrix3r> deltas(count, Matrix3r::Constant((Real)1e-4)), results(count);
+
+	for (int k = 0; k < KERNEL_COUNT; k++)
+	{
+		kernel_table[k].best = 0;
+	}
+
+	// Kernels run in step order, so each sees the state it would in a simulation;
+	// particles do not move, so every repetition does the same work
+	for (int r = 0; r < repetitions; r++)
+	{
+		measure(K_MASS, [&]() { grid->initializeMass(); });
+		measure(K_VELOCITIES, [&]() { grid->initializeVelocities(dt); });
+		measure(K_FORCES, [&]() { grid->explicitVelocities(gravity, dt); });
+		measure(K_AFFINE, [&]() { grid->updateAffineState(); });
+		measure(K_GATHER, [&]() { grid->updateVelocities(dt); });
+		measure(K_PLASTICITY, [&]() {
+			pool->parallelFor(batches, [&](int begin, int end) {
+				p.applyPlasticity(begin * PARTICLE_LANES, std::min(end * PARTICLE_LANES, count));
+			});
+		});
+		measure(K_HESSIAN, [&]() {
+			pool->parallelFor(count, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+				{
+					results[i] = p.deltaEnergyDerivative(i, deltas[i]);
+				}
+			});
+		});
+		measure(K_FUSED, [&]() { grid->particleToGrid(dt); });
+	}
+
+	for (int k = 0; k < KERNEL_COUNT; k++)
+	{
+		double t = kernel_table[k].best;
+		printf("%-9s %8d  %-22s %9.3f ms %9.2f Mp/s %7.2f GB/s\n",
+			layout_names[layout], count, kernel_table[k].name, t * 1e3,
+			count / t * 1e-6, kernel_table[k].bytes * (double)count / t * 1e-9);
+	}
+	printf("%-9s %8d  %d active nodes in %d blocks\n\n",
+		layout_names[layout], count, (int)grid->active_nodes.size(), grid->block_count);
+
+	delete grid;
+	delete cloud;
+}
+
+// Batched SVD against Eigen's JacobiSVD on the same matrices: speed and agreement
+static void benchmarkSvd(int count)
+{
+	typedef Svd3<Real, PARTICLE_LANES> Svd;
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<double> entry(-1, 1);
+
+	int batches = (count + PARTICLE_LANES - 1) / PARTICLE_LANES;
+	count = batches * PARTICLE_LANES;
+	AlignedVector<Matrix3r> a(count);
+	for (int i = 0; i < count; i++)
+	{
+		a[i] = Matrix3r::Identity();
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				a[i](r, c) += (Real)(0.3 * entry(rng));
+			}
+		}
+	}
+
+	AlignedVector<Vector3r> sigma(count);
+	AlignedVector<Matrix3r> u(count), v(count);
+	Clock::time_point start = Clock::now();
+	for (int b = 0; b < batches; b++)
+	{
+		Svd::Vec la[3][3], lu[3][3], ls[3], lv[3][3];
+		for (int l = 0; l < PARTICLE_LANES; l++)
+		{
+			for (int r = 0; r < 3; r++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					la[r][c][l] = a[b * PARTICLE_LANES + l](r, c);
+				}
+			}
+		}
+		Svd::compute(la, lu, ls, lv);
+		for (int l = 0; l < PARTICLE_LANES; l++)
+		{
+			int i = b * PARTICLE_LANES + l;
+			for (int r = 0; r < 3; r++)
+			{
+				sigma[i][r] = ls[r][l];
+				for (int c = 0; c < 3; c++)
+				{
+					u[i](r, c) = lu[r][c][l];
+					v[i](r, c) = lv[r][c][l];
+				}
+			}
+		}
+	}
+	double batched = std::chrono::duration<double>(Clock::now() - start).count();
+
+	double max_sigma = 0, max_residual = 0;
+	start = Clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		Eigen::JacobiSVD<Matrix3r> svd(a[i], Eigen::ComputeFullU | Eigen::ComputeFullV);
+		// Eigen keeps singular values non-negative; Svd3 moves a reflection into sigma[2]
+		Vector3r reference = svd.singularValues(), found = sigma[i].cwiseAbs();
+		max_sigma = std::max(max_sigma, (double)(reference - found).cwiseAbs().maxCoeff());
+		Matrix3r rebuilt = u[i] * sigma[i].asDiagonal() * v[i].transpose();
+		max_residual = std::max(max_residual, (double)((rebuilt - a[i]).norm() / a[i].norm()));
+	}
+	double eigen = std::chrono::duration<double>(Clock::now() - start).count();
+
+	printf("svd       %8d  Svd3 %.1f ns, JacobiSVD %.1f ns per matrix (JacobiSVD time includes the checks)\n",
+		count, batched / count * 1e9, eigen / count * 1e9);
+	printf("svd       %8d  max singular value error %.3g, max relative residual %.3g\n\n", count, max_sigma, max_residual);
+}
+
+int main(int argc, char** argv)
+{
+	int max_particles = argc > 1 ? atoi(argv[1]) : 1000000,
+		repetitions = argc > 2 ? atoi(argv[2]) : 5,
+		workers = argc > 3 ? atoi(argv[3]) : WORKER_THREADS;
+	if (max_particles <= 0 || repetitions <= 0 || workers < 0)
+	{
+		fprintf(stderr, "usage: %s [max_particles] [repetitions] [workers]\n", argv[0]);
+		return 1;
+	}
+
+	ThreadPool pool(workers);
+	printf("%s precision, %d workers, best of %d\n\n", sizeof(Real) > 4 ? "double" : "single", pool.size(), repetitions);
+
+	const int sizes[] = { 10000, 100000, 1000000 };
+	for (int s = 0; s < 3 && sizes[s] <= max_particles; s++)
+	{
+		for (int layout = 0; layout < LAYOUT_COUNT; layout++)
+		{
+			benchmark((Layout)layout, sizes[s], repetitions, &pool);
+		}
+	}
+
+	benchmarkSvd(std::min(max_particles, 100000));
+
+	return 0;
+}
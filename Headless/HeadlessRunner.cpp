@@ -0,0 +1,279 @@
+// Command-line runner: simulates a scene without the renderer and reports where the time goes
+// Usage: mpm-headless [scene number|scene file] [steps] [workers] [--trace file.csv|file.json]
+//                     [--checkpoint file [--every steps]] [--resume file]
+//                     [--export prefix [--export-every steps] [--ply] [--compress [--bits 16|21]]]
+//                     [--scale factor] [--set "key values"]...
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Simulator.h"
+
+int main(int argc, char** argv)
+{
+	int args[3] = { 0, 100, WORKER_THREADS }, positional = 0;
+	const char* scene_path = NULL;
+	double scale = 1;
+	std::vector<std::string> settings;
+	const char* trace_path = NULL;
+	const char* checkpoint_path = NULL;
+	const char* resume_path = NULL;
+	int checkpoint_interval = CHECKPOINT_INTERVAL;
+	const char* export_prefix = NULL;
+	int export_interval = EXPORT_INTERVAL, export_formats = FRAME_BINARY, export_bits = EXPORT_POSITION_BITS;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+		{
+			trace_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+		{
+			checkpoint_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--every") == 0 && i + 1 < argc)
+		{
+			checkpoint_interval = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc)
+		{
+			resume_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc)
+		{
+			export_prefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "--export-every") == 0 && i + 1 < argc)
+		{
+			export_interval = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--ply") == 0)
+		{
+			export_formats |= FRAME_PLY;
+		}
+		else if (strcmp(argv[i], "--compress") == 0)
+		{
+			// The compressed stream replaces the raw frames
+			export_formats = (export_formats & ~FRAME_BINARY) | FRAME_COMPRESSED;
+		}
+		else if (strcmp(argv[i], "--bits") == 0 && i + 1 < argc)
+		{
+			export_bits = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+		{
+			scale = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--set") == 0 && i + 1 < argc)
+		{
+			settings.push_back(argv[++i]);
+		}
+		else if (positional == 0 && argv[i][strspn(argv[i], "0123456789")] != 0)
+		{
+			// Not a built-in scene number
+			scene_path = argv[i];
+			positional++;
+		}
+		else if (argv[i][0] != '-' && positional < 3)
+		{
+			args[positional++] = atoi(argv[i]);
+		}
+		else
+		{
+			fprintf(stderr, "usage: %s [scene number|scene file] [steps] [workers] [--trace file.csv|file.json]"
+				" [--checkpoint file [--every steps]] [--resume file]"
+				" [--export prefix [--export-every steps] [--ply] [--compress [--bits 16|21]]]"
+				" [--scale factor] [--set \"key values\"]...\n", argv[0]);
+			return 1;
+		}
+	}
+	int scene_id = args[0], steps = args[1], workers = args[2];
+	if (export_bits < 1 || export_bits > FRAME_MAX_POSITION_BITS)
+	{
+		fprintf(stderr, "--bits must be between 1 and %d\n", FRAME_MAX_POSITION_BITS);
+		return 1;
+	}
+	std::string scene_name = scene_path != NULL ? scene_path : "scene " + std::to_string(scene_id);
+
+	// A checkpoint replaces the scene
+	Simulator* resumed = NULL;
+	if (resume_path != NULL)
+	{
+		// The grid and particles come from the checkpoint as saved, so the scene cannot be changed
+		if (!settings.empty() || scale != 1)
+		{
+			fprintf(stderr, "--set and --scale cannot be combined with --resume\n");
+			return 1;
+		}
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::string error;
+		resumed = Checkpoint::load(resume_path, workers, error);
+		if (resumed == NULL)
+		{
+			fprintf(stderr, "cannot load checkpoint %s\n", error.c_str());
+			return 1;
+		}
+		printf("resumed %s at step %d in %.3f s\n", resume_path, resumed->step,
+			std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+	else
+	{
+		Scene* scene = NULL;
+		if (scene_path != NULL)
+		{
+			std::string error;
+			scene = Scene::LoadScene(scene_path, error);
+			if (scene == NULL)
+			{
+				fprintf(stderr, "%s\n", error.c_str());
+				return 1;
+			}
+		}
+		else
+		{
+			scene = Scene::GenerateScene(scene_id);
+		}
+
+		// Overrides from the command line, then resolution scaling, so one scene covers a whole sweep
+		std::string error;
+		for (size_t s = 0; s < settings.size(); s++)
+		{
+			if (!scene->config.set(settings[s], error))
+			{
+				fprintf(stderr, "--set %s: %s\n", settings[s].c_str(), error.c_str());
+				return 1;
+			}
+		}
+		if (scale <= 0)
+		{
+			fprintf(stderr, "--scale must be positive\n");
+			return 1;
+		}
+		scene->config.scaleResolution(scale);
+		if (!scene->config.validate(error))
+		{
+			fprintf(stderr, "%s: %s\n", scene_name.c_str(), error.c_str());
+			return 1;
+		}
+		resumed = new Simulator(scene, workers);
+		if (resumed->point_cloud == NULL)
+		{
+			fprintf(stderr, "%s has no snow\n", scene_name.c_str());
+			delete resumed;
+			return 1;
+		}
+	}
+	Simulator& simulator = *resumed;
+
+	simulator.profiling = true;
+	StepTrace* trace = NULL;
+	if (trace_path != NULL)
+	{
+		trace = new StepTrace(trace_path);
+		if (!trace->isOpen())
+		{
+			fprintf(stderr, "cannot write %s\n", trace_path);
+			return 1;
+		}
+		simulator.trace = trace;
+	}
+
+	CheckpointWriter* checkpoints = NULL;
+	if (checkpoint_path != NULL)
+	{
+		checkpoints = new CheckpointWriter(checkpoint_path);
+		simulator.checkpoints = checkpoints;
+		simulator.checkpoint_interval = checkpoint_interval;
+	}
+
+	FrameExporter* exporter = NULL;
+	if (export_prefix != NULL)
+	{
+		exporter = new FrameExporter(export_prefix, export_formats);
+		exporter->codec.position_bits = export_bits;
+		simulator.exporter = exporter;
+		simulator.export_interval = export_interval;
+	}
+
+	printf("%s: %d particles, %d workers\n", scene_name.c_str(), simulator.point_cloud->size, simulator.thread_pool->size());
+
+	// Per-step figures are averaged over the run, and the worst step is kept
+	double ns_per_particle = 0, worst_step = 0;
+	long long active_nodes = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int s = 0; s < steps; s++)
+	{
+		simulator.update();
+
+		ns_per_particle += simulator.stats.nsPerParticle();
+		active_nodes += simulator.stats.active_nodes;
+		if (simulator.stats.total_time > worst_step)
+		{
+			worst_step = simulator.stats.total_time;
+		}
+	}
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (trace != NULL)
+	{
+		trace->close();
+		delete trace;
+	}
+
+	if (exporter != NULL)
+	{
+		exporter->wait();
+		printf("frames: %d written, %d dropped, %d failed\n", exporter->written, exporter->dropped, exporter->failed);
+		const FrameEncoder* encoder = exporter->encoder;
+		if (encoder != NULL && encoder->encoded_bytes > 0)
+		{
+			printf("compressed %.2f MB to %.2f MB (%.1fx), position error <= %.3g m\n",
+				encoder->raw_bytes / 1e6, encoder->encoded_bytes / 1e6,
+				(double)encoder->raw_bytes / encoder->encoded_bytes, encoder->max_position_error);
+		}
+		delete exporter;
+		simulator.exporter = NULL;
+	}
+
+	// The final state is always saved, once any periodic snapshot still in flight is done
+	if (checkpoints != NULL)
+	{
+		checkpoints->wait();
+		printf("periodic checkpoints: %d written, %d skipped, %d failed\n", checkpoints->written, checkpoints->skipped, checkpoints->failed);
+		delete checkpoints;
+		simulator.checkpoints = NULL;
+
+		if (!Checkpoint::save(simulator, checkpoint_path))
+		{
+			fprintf(stderr, "cannot write checkpoint %s\n", checkpoint_path);
+			delete resumed;
+			return 1;
+		}
+		printf("saved step %d to %s\n", simulator.step, checkpoint_path);
+	}
+
+	printf("%d steps, %.6f s simulated, last dt %.3g s\n", steps, simulator.time, simulator.timestep);
+	if (simulator.grid->stray_particles > 0)
+	{
+		fprintf(stderr, "warning: particles left the grid %lld times and were put back at its edge; the timestep is likely too long\n",
+			simulator.grid->stray_particles);
+	}
+	printf("wall %.3f s, %.2f steps/s, slowest step %.2f ms\n", wall, steps > 0 ? steps / wall : 0.0, worst_step * 1e3);
+	if (steps > 0)
+	{
+		printf("%.1f ns/particle/step, %lld active nodes/step\n", ns_per_particle / steps, active_nodes / steps);
+	}
+	for (int p = 0; p < PHASE_COUNT; p++)
+	{
+		double t = simulator.phase_time[p];
+		printf("  %-10s %9.3f s %6.1f%%\n", StepStats::phaseName(p), t, wall > 0 ? 100 * t / wall : 0.0);
+	}
+
+	delete resumed;
+	return 0;
+}
@@ -326,7 +326,24 @@ void SceneRenderer::SetupScene()
 {
 	if (m_snowSimulator == nullptr)
 	{
-		Scene* scene = Scene::GenerateScene(7); // Parameter: scene type
+		// A scene file next to the app replaces the built-in scene
+		Scene* scene = nullptr;
+		FILE* file = fopen("default.scene", "r");
+		if (file != nullptr)
+		{
+			fclose(file);
+			// A broken scene file is reported, then the built-in scene runs instead
+			std::string error;
+			scene = Scene::LoadScene("default.scene", error);
+			if (scene == nullptr)
+			{
+				OutputDebugStringA((error + "\n").c_str());
+			}
+		}
+		if (scene == nullptr)
+		{
+			scene = Scene::GenerateScene(7); // Parameter: scene type
+		}
 		m_snowSimulator = new Simulator(scene);
 	}
 }
@@ -342,18 +359,18 @@ void SceneRenderer::AcquireVertices()
 
 	for (int i = 0; i < m_snowSimulator->point_cloud->size; i++)
 	{
-		Particle& p = m_snowSimulator->point_cloud->particles[i];
+		ParticleArrays& p = m_snowSimulator->point_cloud->particles;
 		// Use the particle's density to vary color
 		float contrast = 0.5f;
-		float density = p.density / DENSITY * contrast;
+		float density = p.density[i] / DENSITY * contrast;
 		density += 1 - contrast;
 
 		m_vertices[i] = {
 			XMFLOAT3(( // Add an offset to translate the particles into the center of view field
-				(float)p.position(0) - 1) * 2,	// x
-				(float)p.position(1) * 2 - 1,	// y
-				(float)p.position(2) * 2 - 1),  // z
-			XMFLOAT4(density * 0.9f, density * 0.95f, density, p.volume) }; // color & volume
+				(float)p.position[i](0) - 1) * 2,	// x
+				(float)p.position[i](1) * 2 - 1,	// y
+				(float)p.position[i](2) * 2 - 1),  // z
+			XMFLOAT4(density * 0.9f, density * 0.95f, density, p.volume[i]) }; // color & volume
 	}
 }
 
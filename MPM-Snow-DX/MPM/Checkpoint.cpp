@@ -0,0 +1,485 @@
+#include "Checkpoint.h"
+#include "Simulator.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char CHECKPOINT_MAGIC[8] = { 'M', 'P', 'M', 'S', 'N', 'O', 'W', 0 };
+
+// Persistent particle fields; ids are part of the file format
+enum FieldId
+{
+	FIELD_POSITION = 1,
+	FIELD_VELOCITY,
+	FIELD_DEF_ELASTIC,
+	FIELD_DEF_PLASTIC,
+	FIELD_AFFINE_STATE,
+	FIELD_VOLUME,
+	FIELD_MASS,
+	FIELD_PLASTIC_DET,
+	FIELD_STRESS,
+	FIELD_SVD_W,
+	FIELD_SVD_V,
+	FIELD_SVD_E,
+	FIELD_DENSITY,
+	FIELD_ID,
+	FIELD_MATERIAL
+};
+static const int FIELD_COUNT = 15;
+
+struct FieldRef
+{
+	uint32_t id;
+	uint32_t element_size;
+	char* data;
+};
+
+template <typename T>
+static FieldRef fieldRef(uint32_t id, AlignedVector<T>& field)
+{
+	FieldRef f = { id, (uint32_t)sizeof(T), (char*)field.data() };
+	return f;
+}
+
+// The stress and the cached SVD could be recomputed, but only by re-running the plasticity
+// update, which would perturb Fe in the last bits; they are stored so a restart is exact
+static void listFields(ParticleArrays& p, FieldRef fields[FIELD_COUNT])
+{
+	int n = 0;
+	fields[n++] = fieldRef(FIELD_POSITION, p.position);
+	fields[n++] = fieldRef(FIELD_VELOCITY, p.velocity);
+	fields[n++] = fieldRef(FIELD_DEF_ELASTIC, p.def_elastic);
+	fields[n++] = fieldRef(FIELD_DEF_PLASTIC, p.def_plastic);
+	fields[n++] = fieldRef(FIELD_AFFINE_STATE, p.affine_state);
+	fields[n++] = fieldRef(FIELD_VOLUME, p.volume);
+	fields[n++] = fieldRef(FIELD_MASS, p.mass);
+	fields[n++] = fieldRef(FIELD_MATERIAL, p.material);
+	fields[n++] = fieldRef(FIELD_PLASTIC_DET, p.plastic_det);
+	fields[n++] = fieldRef(FIELD_STRESS, p.stress);
+	fields[n++] = fieldRef(FIELD_SVD_W, p.svd_w);
+	fields[n++] = fieldRef(FIELD_SVD_V, p.svd_v);
+	fields[n++] = fieldRef(FIELD_SVD_E, p.svd_e);
+	fields[n++] = fieldRef(FIELD_DENSITY, p.density);
+	fields[n++] = fieldRef(FIELD_ID, p.id);
+}
+
+static uint64_t alignUp(uint64_t offset)
+{
+	return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+
+// The grid keeps its own copies of some settings, which may have been changed since;
+// those copies are the ones stored
+static void packConfig(const Simulator& simulator, CheckpointConfig& out)
+{
+	const SimulationConfig& config = simulator.config;
+	const Grid* grid = simulator.grid;
+
+	for (int d = 0; d < 3; d++)
+	{
+		out.origin[d] = grid->origin[d];
+		out.cells[d] = grid->size[d] - 1;
+		out.dims[d] = out.cells[d] * grid->cellsize[d];
+		out.gravity[d] = config.gravity[d];
+	}
+	out.particle_diameter = config.particle_diameter;
+	out.density = config.density;
+	out.sticky = grid->sticky;
+	out.timestep = config.timestep;
+	out.max_timestep = config.max_timestep;
+	out.cfl_number = config.cfl_number;
+	out.elastic_cfl = config.elastic_cfl;
+	out.implicit_ratio = grid->implicit_ratio;
+	out.implicit_tolerance = grid->implicit_tolerance;
+	out.implicit_iterations = grid->max_implicit_iterations;
+	out.sort_interval = config.sort_interval;
+	out.kernel = grid->kernel;
+	out.adaptive_timestep = config.adaptive_timestep;
+	out.closed_form_inertia = grid->closed_form_inertia;
+	out.mls_transfer = grid->mls_transfer;
+	out.implicit_solve = grid->implicit_solve;
+}
+
+static void unpackConfig(const CheckpointConfig& in, SimulationConfig& config)
+{
+	config.origin = Eigen::Vector3d(in.origin[0], in.origin[1], in.origin[2]);
+	config.dims = Eigen::Vector3d(in.dims[0], in.dims[1], in.dims[2]);
+	config.cells = Eigen::Vector3d(in.cells[0], in.cells[1], in.cells[2]);
+	config.gravity = Eigen::Vector3d(in.gravity[0], in.gravity[1], in.gravity[2]);
+	config.particle_diameter = in.particle_diameter;
+	config.density = in.density;
+	config.sticky = in.sticky;
+	config.timestep = in.timestep;
+	config.max_timestep = in.max_timestep;
+	config.cfl_number = in.cfl_number;
+	config.elastic_cfl = in.elastic_cfl;
+	config.implicit_ratio = in.implicit_ratio;
+	config.implicit_tolerance = in.implicit_tolerance;
+	config.implicit_iterations = in.implicit_iterations;
+	config.sort_interval = in.sort_interval;
+	config.kernel = in.kernel == KERNEL_QUADRATIC ? KERNEL_QUADRATIC : KERNEL_CUBIC;
+	config.adaptive_timestep = in.adaptive_timestep != 0;
+	config.closed_form_inertia = in.closed_form_inertia != 0;
+	config.mls_transfer = in.mls_transfer != 0;
+	config.implicit_solve = in.implicit_solve != 0;
+}
+
+static void packMaterial(const SnowMaterial& material, CheckpointMaterial& out)
+{
+	strncpy(out.name, material.name.c_str(), sizeof(out.name) - 1);
+	out.youngs_modulus = material.youngs_modulus;
+	out.poissons_ratio = material.poissons_ratio;
+	out.crit_compress = material.crit_compress;
+	out.crit_stretch = material.crit_stretch;
+	out.hardening = material.hardening;
+}
+
+static void unpackMaterial(const CheckpointMaterial& in, SnowMaterial& material)
+{
+	material.name = std::string(in.name, strnlen(in.name, sizeof(in.name)));
+	material.youngs_modulus = in.youngs_modulus;
+	material.poissons_ratio = in.poissons_ratio;
+	material.crit_compress = in.crit_compress;
+	material.crit_stretch = in.crit_stretch;
+	material.hardening = in.hardening;
+}
+
+
+void Checkpoint::serialize(const Simulator& simulator, std::vector<char>& out)
+{
+	const PointCloud* cloud = simulator.point_cloud;
+	int count = cloud->size;
+
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.scalar_size = sizeof(Real);
+	header.particles = count;
+	header.step = simulator.step;
+	header.field_count = FIELD_COUNT;
+	header.time = simulator.time;
+	header.timestep = simulator.timestep;
+	header.max_velocity = cloud->max_velocity;
+	header.max_wave_speed = cloud->max_wave_speed;
+	packConfig(simulator, header.config);
+
+	const std::vector<SnowMaterial>& config_materials = simulator.config.materials;
+	header.material_count = (int32_t)config_materials.size();
+	std::vector<CheckpointMaterial> materials(config_materials.size());
+	for (size_t m = 0; m < materials.size(); m++)
+	{
+		packMaterial(config_materials[m], materials[m]);
+	}
+	size_t materials_bytes = materials.size() * sizeof(CheckpointMaterial);
+
+	// Fields are only read here
+	FieldRef fields[FIELD_COUNT];
+	listFields(const_cast<ParticleArrays&>(cloud->particles), fields);
+
+	CheckpointField table[FIELD_COUNT];
+	uint64_t offset = alignUp(sizeof(header) + sizeof(table) + materials_bytes);
+	for (int f = 0; f < FIELD_COUNT; f++)
+	{
+		table[f].id = fields[f].id;
+		table[f].element_size = fields[f].element_size;
+		table[f].offset = offset;
+		offset = alignUp(offset + (uint64_t)fields[f].element_size * count);
+	}
+
+	out.assign((size_t)offset, 0);
+	memcpy(&out[0], &header, sizeof(header));
+	memcpy(&out[sizeof(header)], table, sizeof(table));
+	memcpy(&out[sizeof(header) + sizeof(table)], materials.data(), materials_bytes);
+	for (int f = 0; f < FIELD_COUNT; f++)
+	{
+		memcpy(&out[(size_t)table[f].offset], fields[f].data, (size_t)fields[f].element_size * count);
+	}
+}
+
+bool Checkpoint::writeFile(const std::vector<char>& data, const char* path)
+{
+	std::string temporary = std::string(path) + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+
+	// Swap the finished file in, so a crash mid-write leaves the previous checkpoint intact
+	// rename does not replace existing files on Windows
+#ifdef _WIN32
+	remove(path);
+#endif
+	return rename(temporary.c_str(), path) == 0;
+}
+
+bool Checkpoint::save(const Simulator& simulator, const char* path)
+{
+	std::vector<char> data;
+	serialize(simulator, data);
+	return writeFile(data, path);
+}
+
+
+// Read-only view of a whole file
+// Pages are only read when the fields are copied out, straight from the page cache
+class MappedFile
+{
+public:
+	const char* data;
+	uint64_t size;
+
+	MappedFile(const char* path) : data(NULL), size(0)
+	{
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+
+		wchar_t wide[MAX_PATH];
+		if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide, MAX_PATH) == 0)
+		{
+			return;
+		}
+		file = CreateFile2(wide, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, NULL);
+		LARGE_INTEGER length;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length) || length.QuadPart == 0)
+		{
+			return;
+		}
+		mapping = CreateFileMappingFromApp(file, NULL, PAGE_READONLY, 0, NULL);
+		if (mapping == NULL)
+		{
+			return;
+		}
+		data = (const char*)MapViewOfFileFromApp(mapping, FILE_MAP_READ, 0, 0);
+		size = data != NULL ? (uint64_t)length.QuadPart : 0;
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+		{
+			return;
+		}
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+			void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (view != MAP_FAILED)
+			{
+				madvise(view, (size_t)info.st_size, MADV_SEQUENTIAL);
+				data = (const char*)view;
+				size = (uint64_t)info.st_size;
+			}
+		}
+		close(fd);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (data != NULL) UnmapViewOfFile(data);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (data != NULL) munmap((void*)data, (size_t)size);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
+};
+
+Simulator* Checkpoint::load(const char* path, int workers, std::string& error)
+{
+	MappedFile file(path);
+	if (file.data == NULL)
+	{
+		error = std::string(path) + ": cannot open";
+		return NULL;
+	}
+	if (file.size < sizeof(CheckpointHeader))
+	{
+		error = std::string(path) + ": truncated header";
+		return NULL;
+	}
+
+	CheckpointHeader header;
+	memcpy(&header, file.data, sizeof(header));
+	if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != CHECKPOINT_VERSION)
+	{
+		error = std::string(path) + ": not a version " + std::to_string(CHECKPOINT_VERSION) + " checkpoint";
+		return NULL;
+	}
+	if (header.scalar_size != sizeof(Real))
+	{
+		error = std::string(path) + ": saved by a " + (header.scalar_size > 4 ? "double" : "single") + " precision build";
+		return NULL;
+	}
+	if (header.particles <= 0
+		|| header.field_count <= 0
+		|| header.material_count <= 0
+		|| sizeof(header) + (uint64_t)header.field_count * sizeof(CheckpointField)
+			+ (uint64_t)header.material_count * sizeof(CheckpointMaterial) > file.size)
+	{
+		error = std::string(path) + ": corrupt or truncated header";
+		return NULL;
+	}
+
+	SimulationConfig config;
+	unpackConfig(header.config, config);
+	const CheckpointMaterial* materials = (const CheckpointMaterial*)(file.data + sizeof(header)
+		+ header.field_count * sizeof(CheckpointField));
+	config.materials.resize(header.material_count);
+	for (int m = 0; m < header.material_count; m++)
+	{
+		unpackMaterial(materials[m], config.materials[m]);
+	}
+	// The grid and particle arrays are sized from the config, so a corrupt one is rejected before either exists
+	if (!config.validate(error))
+	{
+		error = std::string(path) + ": " + error;
+		return NULL;
+	}
+
+	int count = header.particles;
+	PointCloud* cloud = new PointCloud(count);
+	cloud->particles.resize(count);
+	cloud->particles.configure(config);
+	cloud->max_velocity = header.max_velocity;
+	cloud->max_wave_speed = header.max_wave_speed;
+
+	// Every field this build keeps must be present, with the expected element size
+	FieldRef fields[FIELD_COUNT];
+	listFields(cloud->particles, fields);
+	const CheckpointField* table = (const CheckpointField*)(file.data + sizeof(header));
+	for (int f = 0; f < FIELD_COUNT; f++)
+	{
+		const CheckpointField* stored = NULL;
+		for (int t = 0; t < header.field_count; t++)
+		{
+			if (table[t].id == fields[f].id)
+			{
+				stored = &table[t];
+			}
+		}
+
+		uint64_t bytes = (uint64_t)fields[f].element_size * count;
+		if (stored == NULL || stored->element_size != fields[f].element_size
+			|| stored->offset > file.size || bytes > file.size - stored->offset)
+		{
+			error = std::string(path) + ": particle field " + std::to_string(fields[f].id) + " is missing or truncated";
+			delete cloud;
+			return NULL;
+		}
+		memcpy(fields[f].data, file.data + stored->offset, (size_t)bytes);
+	}
+
+	ParticleArrays& particles = cloud->particles;
+	for (int i = 0; i < count; i++)
+	{
+		if (particles.material[i] < 0 || particles.material[i] >= header.material_count)
+		{
+			error = std::string(path) + ": particle " + std::to_string(i) + " has no material";
+			delete cloud;
+			return NULL;
+		}
+	}
+	particles.groupMaterials();
+
+	Grid* grid = new Grid(config, cloud);
+
+	Simulator* simulator = new Simulator(config, cloud, grid, workers);
+	simulator->step = header.step;
+	simulator->time = header.time;
+	simulator->timestep = header.timestep;
+
+	return simulator;
+}
+
+
+CheckpointWriter::CheckpointWriter(const char* path) :
+	written(0), skipped(0), failed(0),
+	path(path),
+	pending(false), stopping(false)
+{
+	thread = std::thread(&CheckpointWriter::writerLoop, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	signal.notify_all();
+	thread.join();
+}
+
+bool CheckpointWriter::snapshot(const Simulator& simulator)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (pending)
+	{
+		skipped++;
+		return false;
+	}
+
+	// The buffer is not touched by the writer thread while nothing is pending
+	Checkpoint::serialize(simulator, buffer);
+	pending = true;
+	signal.notify_all();
+	return true;
+}
+
+void CheckpointWriter::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	signal.wait(lock, [this] { return !pending; });
+}
+
+void CheckpointWriter::writerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		// Pending snapshots are written before stopping
+		signal.wait(lock, [this] { return pending || stopping; });
+		if (!pending)
+		{
+			return;
+		}
+
+		lock.unlock();
+		bool ok = Checkpoint::writeFile(buffer, path.c_str());
+		lock.lock();
+
+		if (ok) written++;
+		else failed++;
+		pending = false;
+		signal.notify_all();
+	}
+}
\ No newline at end of file
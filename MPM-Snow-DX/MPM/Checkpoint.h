@@ -0,0 +1,119 @@
+#pragma once
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class Simulator;
+
+// Binary snapshot of a simulation, for restarting long runs
+//
+// Layout (little-endian):
+//   CheckpointHeader
+//   field_count CheckpointField entries
+//   material_count CheckpointMaterial entries
+//   particle fields, each as one contiguous array starting on a CHECKPOINT_ALIGN boundary
+//
+// Only the particle state carried from one step to the next is stored; the grid is rebuilt
+// from its configuration every step, so a resumed run continues exactly as the original would
+const uint32_t CHECKPOINT_VERSION = 4;
+const int CHECKPOINT_ALIGN = 64;
+
+// SimulationConfig in a fixed layout
+struct CheckpointConfig
+{
+	double origin[3], dims[3], cells[3], gravity[3];
+	double particle_diameter, density, sticky;
+	double timestep, max_timestep, cfl_number, elastic_cfl;
+	double implicit_ratio, implicit_tolerance;
+	int32_t implicit_iterations, sort_interval, kernel;
+	uint8_t adaptive_timestep, closed_form_inertia, mls_transfer, implicit_solve;
+};
+
+struct CheckpointHeader
+{
+	char magic[8];				// "MPMSNOW\0"
+	uint32_t version;
+	uint32_t scalar_size;		// sizeof(Real) of the build that wrote it; must match to load
+	int32_t particles;
+	int32_t step;
+	int32_t field_count;
+	int32_t material_count;
+	double time, timestep;
+	double max_velocity, max_wave_speed;	// Squared, as kept by PointCloud
+	CheckpointConfig config;
+};
+
+// SnowMaterial in a fixed layout; names longer than the field are cut short
+struct CheckpointMaterial
+{
+	char name[32];
+	double youngs_modulus, poissons_ratio;
+	double crit_compress, crit_stretch, hardening;
+};
+
+// Where one particle field is stored
+struct CheckpointField
+{
+	uint32_t id;
+	uint32_t element_size;
+	uint64_t offset;
+};
+
+class Checkpoint
+{
+public:
+	// Serialize the simulation into a buffer; cheap enough to run between steps
+	static void serialize(const Simulator& simulator, std::vector<char>& out);
+
+	// Write a checkpoint synchronously; the file is replaced only once it is complete
+	static bool save(const Simulator& simulator, const char* path);
+
+	// Map a checkpoint and rebuild the simulation from it
+	// Returns NULL if the file is missing, truncated, corrupt, from another format version or another precision,
+	// with the reason in error
+	static Simulator* load(const char* path, int workers, std::string& error);
+
+	// Write a serialized buffer to path through a temporary file
+	static bool writeFile(const std::vector<char>& data, const char* path);
+};
+
+// Takes snapshots between steps and writes them on a background thread
+// The simulation only pays for copying its state; a snapshot requested while the previous one is
+// still being written is skipped, so a slow disk never stalls the run
+class CheckpointWriter
+{
+public:
+	// Every snapshot replaces the file at path
+	CheckpointWriter(const char* path);
+	// Owns its writer thread, so it cannot be copied
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+	virtual ~CheckpointWriter();
+
+	// Returns false if the snapshot was skipped
+	bool snapshot(const Simulator& simulator);
+
+	// Block until the pending snapshot, if any, is on disk
+	void wait();
+
+	// Snapshots written, skipped and failed so far
+	int written, skipped, failed;
+
+private:
+	std::string path;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable signal;
+	std::vector<char> buffer;
+	bool pending, stopping;
+
+	void writerLoop();
+};
+
+#endif // !CHECKPOINT_H
\ No newline at end of file
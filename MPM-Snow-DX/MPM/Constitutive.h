@@ -0,0 +1,38 @@
+#pragma once
+#ifndef CONSTITUTIVE_H
+#define CONSTITUTIVE_H
+
+#include "Lanes.h"
+
+// Fixed-corotated elasticity (Stomakhin et al. 2012), for batches of particles
+template <typename T, int N>
+struct FixedCorotated
+{
+	typedef Lanes<T, N> Vec;
+
+	// Stress P Fe^T = 2 mu (Fe - R) Fe^T + lambda Je (Je - 1) I of Fe = U diag(e) V^T, times scale
+	// With R = U V^T, (Fe - R) Fe^T = U diag(e (e - 1)) U^T, so V is not needed and the result is symmetric
+	static void stress(const Vec u[3][3], const Vec e[3], const Vec& mu, const Vec& lambda, const Vec& scale, Vec out[3][3])
+	{
+		Vec d[3];
+		for (int k = 0; k < 3; k++)
+		{
+			d[k] = 2 * mu * scale * e[k] * (e[k] - 1);
+		}
+
+		Vec je = e[0] * e[1] * e[2];
+		Vec contour = lambda * scale * je * (je - 1);
+
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = i; j < 3; j++)
+			{
+				out[i][j] = u[i][0] * d[0] * u[j][0] + u[i][1] * d[1] * u[j][1] + u[i][2] * d[2] * u[j][2];
+				out[j][i] = out[i][j];
+			}
+			out[i][i] += contour;
+		}
+	}
+};
+
+#endif // !CONSTITUTIVE_H
\ No newline at end of file
@@ -3,9 +3,34 @@
 #define CUSTOM_MATH_H
 
 #include <math.h>
-#include <Eigen\Dense>
-
-static void loadIdentity(Eigen::Matrix3d& m)
+#include <Eigen/Dense>
+
+// Scalar type of the simulation state
+// Define MPM_SINGLE_PRECISION to build the particles and transfers in float:
+// half the particle footprint and bandwidth, twice the SIMD width; good enough for preview runs
+#ifdef MPM_SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+// Grid node accumulators (mass, momentum, forces, solver vectors)
+// Each node sums contributions from dozens of particles, so they stay in double unless
+// MPM_SINGLE_ACCUMULATION is also defined
+#if defined(MPM_SINGLE_PRECISION) && defined(MPM_SINGLE_ACCUMULATION)
+typedef float Accum;
+#else
+typedef double Accum;
+#endif
+
+typedef Eigen::Matrix<Real, 3, 1> Vector3r;
+typedef Eigen::Matrix<Real, 3, 3> Matrix3r;
+typedef Eigen::Matrix<Accum, 3, 1> Vector3a;
+
+// Helpers work for any scalar type; scene setup stays in double
+
+template <typename T>
+static void loadIdentity(Eigen::Matrix<T, 3, 3>& m)
 {
 	m(0, 0) = 1; m(0, 1) = 0; m(0, 2) = 0;
 	m(1, 0) = 0; m(1, 1) = 1; m(1, 2) = 0;
@@ -13,13 +38,16 @@ static void loadIdentity(Eigen::Matrix3d& m)
 }
 
 
-static void setData(Eigen::Vector3d& m, const double& x, const double& y, const double& z)
+template <typename T>
+static void setData(Eigen::Matrix<T, 3, 1>& m, const typename Eigen::Matrix<T, 3, 1>::Scalar& x,
+	const typename Eigen::Matrix<T, 3, 1>::Scalar& y, const typename Eigen::Matrix<T, 3, 1>::Scalar& z)
 {
 	m(0) = x; m(1) = y; m(2) = z;
 }
 
 
-static void setData(Eigen::Matrix3d& m, const double& c)
+template <typename T>
+static void setData(Eigen::Matrix<T, 3, 3>& m, const typename Eigen::Matrix<T, 3, 3>::Scalar& c)
 {
 	m(0, 0) = c; m(0, 1) = c; m(0, 2) = c;
 	m(1, 0) = c; m(1, 1) = c; m(1, 2) = c;
@@ -27,7 +55,8 @@ static void setData(Eigen::Matrix3d& m, const double& c)
 }
 
 
-static void diagSum(Eigen::Matrix3d& m, const double& c)
+template <typename T>
+static void diagSum(Eigen::Matrix<T, 3, 3>& m, const typename Eigen::Matrix<T, 3, 3>::Scalar& c)
 {
 	for (int i = 0; i < 3; i++)
 	{
@@ -36,7 +65,8 @@ static void diagSum(Eigen::Matrix3d& m, const double& c)
 }
 
 
-static void diagProduct(Eigen::Matrix3d& m, const Eigen::Vector3d& v)
+template <typename T>
+static void diagProduct(Eigen::Matrix<T, 3, 3>& m, const Eigen::Matrix<T, 3, 1>& v)
 {
 	for (int i = 0; i < 3; i++)
 	{
@@ -48,7 +78,8 @@ static void diagProduct(Eigen::Matrix3d& m, const Eigen::Vector3d& v)
 }
 
 
-static void diagProduct_Inv(Eigen::Matrix3d& m, const Eigen::Vector3d& v)
+template <typename T>
+static void diagProduct_Inv(Eigen::Matrix<T, 3, 3>& m, const Eigen::Matrix<T, 3, 1>& v)
 {
 	for (int i = 0; i < 3; i++)
 	{
@@ -60,33 +91,38 @@ static void diagProduct_Inv(Eigen::Matrix3d& m, const Eigen::Vector3d& v)
 }
 
 
-static double product(const Eigen::Vector3d& v)
+template <typename A>
+static typename A::Scalar product(const Eigen::MatrixBase<A>& v)
 {
 	return v(0) * v(1) * v(2);
 }
 
 
-static double lengthSquared(const Eigen::Vector3d& v)
+template <typename A>
+static typename A::Scalar lengthSquared(const Eigen::MatrixBase<A>& v)
 {
 	return v(0)*v(0) + v(1)*v(1) + v(2)*v(2);
 }
 
 
-static Eigen::Vector3d division(const Eigen::Vector3d& a, const Eigen::Vector3d& b)
+template <typename A, typename B>
+static Eigen::Matrix<typename A::Scalar, 3, 1> division(const Eigen::MatrixBase<A>& a, const Eigen::MatrixBase<B>& b)
 {
-	return Eigen::Vector3d(a(0) / b(0), a(1) / b(1), a(2) / b(2));
+	return Eigen::Matrix<typename A::Scalar, 3, 1>(a(0) / b(0), a(1) / b(1), a(2) / b(2));
 }
 
 
-static Eigen::Vector3d add_const(const Eigen::Vector3d& v, double c)
+template <typename A>
+static Eigen::Matrix<typename A::Scalar, 3, 1> add_const(const Eigen::MatrixBase<A>& v, typename A::Scalar c)
 {
-	return Eigen::Vector3d(v(0) + c, v(1) + c, v(2) + c);
+	return Eigen::Matrix<typename A::Scalar, 3, 1>(v(0) + c, v(1) + c, v(2) + c);
 }
 
 
-static Eigen::Matrix3d outerProduct(const Eigen::Vector3d& a, const Eigen::Vector3d& b)
+template <typename A, typename B>
+static Eigen::Matrix<typename A::Scalar, 3, 3> outerProduct(const Eigen::MatrixBase<A>& a, const Eigen::MatrixBase<B>& b)
 {
-	Eigen::Matrix3d m;
+	Eigen::Matrix<typename A::Scalar, 3, 3> m;
 	m(0, 0) = a(0) * b(0); m(0, 1) = a(0) * b(1); m(0, 2) = a(0) * b(2);
 	m(1, 0) = a(1) * b(0); m(1, 1) = a(1) * b(1); m(1, 2) = a(1) * b(2);
 	m(2, 0) = a(2) * b(0); m(2, 1) = a(2) * b(1); m(2, 2) = a(2) * b(2);
@@ -94,9 +130,60 @@ static Eigen::Matrix3d outerProduct(const Eigen::Vector3d& a, const Eigen::Vecto
 	return m;
 }
 
-static Eigen::Vector3d dot(const Eigen::Vector3d& a, const Eigen::Vector3d& b)
+template <typename A, typename B>
+static Eigen::Matrix<typename A::Scalar, 3, 1> dot(const Eigen::MatrixBase<A>& a, const Eigen::MatrixBase<B>& b)
 {
-	return Eigen::Vector3d(a(0) * b(0), a(1) * b(1), a(2) * b(2));
+	return Eigen::Matrix<typename A::Scalar, 3, 1>(a(0) * b(0), a(1) * b(1), a(2) * b(2));
+}
+
+
+// Cofactor matrix, det(m) * m^-T
+template <typename T>
+static Eigen::Matrix<T, 3, 3> cofactor(const Eigen::Matrix<T, 3, 3>& m)
+{
+	Eigen::Matrix<T, 3, 3> c;
+	for (int i = 0; i < 3; i++)
+	{
+		int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+		for (int j = 0; j < 3; j++)
+		{
+			int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+			c(i, j) = m(i1, j1) * m(i2, j2) - m(i1, j2) * m(i2, j1);
+		}
+	}
+
+	return c;
+}
+
+// Differential of the cofactor matrix at m in the direction dm
+template <typename T>
+static Eigen::Matrix<T, 3, 3> cofactorDelta(const Eigen::Matrix<T, 3, 3>& m, const Eigen::Matrix<T, 3, 3>& dm)
+{
+	Eigen::Matrix<T, 3, 3> c;
+	for (int i = 0; i < 3; i++)
+	{
+		int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+		for (int j = 0; j < 3; j++)
+		{
+			int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+			c(i, j) = dm(i1, j1) * m(i2, j2) + m(i1, j1) * dm(i2, j2)
+					- dm(i1, j2) * m(i2, j1) - m(i1, j2) * dm(i2, j1);
+		}
+	}
+
+	return c;
+}
+
+// Skew-symmetric matrix of the cross product with v
+template <typename A>
+static Eigen::Matrix<typename A::Scalar, 3, 3> skew(const Eigen::MatrixBase<A>& v)
+{
+	Eigen::Matrix<typename A::Scalar, 3, 3> m;
+	m(0, 0) = 0;     m(0, 1) = -v(2); m(0, 2) = v(1);
+	m(1, 0) = v(2);  m(1, 1) = 0;     m(1, 2) = -v(0);
+	m(2, 0) = -v(1); m(2, 1) = v(0);  m(2, 2) = 0;
+
+	return m;
 }
 
-#endif // !CUSTOM_MATH_H
+#endif // !CUSTOM_MATH_H
\ No newline at end of file
@@ -1,8 +1,7 @@
-#include "pch.h"
 #include "Entity.h"
 
-Entity::Entity() {}
-Entity::Entity(Eigen::Vector3d vel) :vel(vel) {}
+Entity::Entity() : material(0) {}
+Entity::Entity(Eigen::Vector3d vel) :vel(vel), material(0) {}
 // Copy constructor
 Entity::Entity(const Entity& orig) {}
 
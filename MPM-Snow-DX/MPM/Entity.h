@@ -5,7 +5,7 @@
 #include <vector>
 #include <math.h>
 
-#include <Eigen\Dense>
+#include <Eigen/Dense>
 #include "CustomMath.h"
 
 const double Pi4_3 = 3.1415926535 * 4 / 3;
@@ -29,6 +29,9 @@ public:
 
 	Eigen::Vector3d vel;
 
+	// Index into SimulationConfig::materials
+	int material;
+
 	Entity();
 	Entity(Eigen::Vector3d vel);
 	Entity(const Entity& orig);
@@ -0,0 +1,588 @@
+#include "FrameCodec.h"
+#include "SimulationParameters.h"
+
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+static const char STREAM_MAGIC[8] = { 'M', 'P', 'M', 'Z', 'S', 'T', 'R', 'M' };
+static const char RECORD_MAGIC[4] = { 'M', 'P', 'M', 'Z' };
+static const char INDEX_MAGIC[4] = { 'M', 'P', 'M', 'I' };
+
+// Block predictors; the first frame after a keyframe cannot extrapolate yet
+enum Predictor
+{
+	PREDICT_PARTICLE = 0,		// Previous particle of the same frame
+	PREDICT_FRAME,				// Same particle in the previous frame
+	PREDICT_LINEAR				// Same particle, extrapolated from the previous two frames
+};
+
+// Residuals of this many or more times 2^k are stored verbatim
+static const uint32_t RICE_ESCAPE = 24;
+
+FrameCodecSettings::FrameCodecSettings() :
+	position_bits(EXPORT_POSITION_BITS),
+	key_interval(EXPORT_KEY_INTERVAL),
+	velocity_step(EXPORT_VELOCITY_STEP),
+	density_step(EXPORT_DENSITY_STEP),
+	volume_step(0)
+{
+}
+
+
+static bool seekTo(FILE* file, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static uint64_t fileSize(FILE* file)
+{
+#ifdef _WIN32
+	_fseeki64(file, 0, SEEK_END);
+	return (uint64_t)_ftelli64(file);
+#else
+	fseeko(file, 0, SEEK_END);
+	return (uint64_t)ftello(file);
+#endif
+}
+
+
+// Bits are packed least significant first
+class BitWriter
+{
+public:
+	BitWriter(std::vector<uint8_t>& out) : out(out), acc(0), bits(0) { out.clear(); }
+
+	// Up to 32 bits; value must fit in count bits
+	void put(uint32_t value, int count)
+	{
+		acc |= (uint64_t)value << bits;
+		bits += count;
+		while (bits >= 8)
+		{
+			out.push_back((uint8_t)acc);
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+
+	void flush()
+	{
+		if (bits > 0)
+		{
+			out.push_back((uint8_t)acc);
+		}
+		acc = 0;
+		bits = 0;
+	}
+
+private:
+	std::vector<uint8_t>& out;
+	uint64_t acc;
+	int bits;
+};
+
+class BitReader
+{
+public:
+	bool overrun;
+
+	BitReader(const std::vector<uint8_t>& in) : overrun(false), in(in), pos(0), acc(0), bits(0) {}
+
+	uint32_t get(int count)
+	{
+		while (bits < count)
+		{
+			if (pos < in.size())
+			{
+				acc |= (uint64_t)in[pos] << bits;
+			}
+			else
+			{
+				overrun = true;
+			}
+			pos++;
+			bits += 8;
+		}
+		uint32_t value = (uint32_t)(acc & ((1ull << count) - 1));
+		acc >>= count;
+		bits -= count;
+		return value;
+	}
+
+private:
+	const std::vector<uint8_t>& in;
+	size_t pos;
+	uint64_t acc;
+	int bits;
+};
+
+
+static uint32_t zigzag(uint32_t r) { return (r << 1) ^ (uint32_t)((int32_t)r >> 31); }
+static uint32_t unzigzag(uint32_t u) { return (u >> 1) ^ (0u - (u & 1)); }
+
+// Residuals are taken modulo 2^32, so every predictor round-trips exactly
+static uint32_t predict(int predictor, const uint32_t* values, const uint32_t* previous, const uint32_t* before, int i)
+{
+	switch (predictor)
+	{
+	case PREDICT_FRAME:
+		return previous[i];
+	case PREDICT_LINEAR:
+		return 2 * previous[i] - before[i];
+	default:
+		return i > 0 ? values[i - 1] : 0;
+	}
+}
+
+// Rice parameter for residuals averaging sum / count, and the approximate size it gives
+static int riceParameter(uint64_t sum, int count, uint64_t& cost)
+{
+	int k = 0;
+	while (k < 31 && ((uint64_t)count << (k + 1)) <= sum)
+	{
+		k++;
+	}
+	cost = (uint64_t)count * (k + 1) + (sum >> k);
+	return k;
+}
+
+static void putRice(BitWriter& out, uint32_t u, int k)
+{
+	uint32_t q = u >> k;
+	if (q < RICE_ESCAPE)
+	{
+		// q ones and a terminating zero
+		out.put((1u << q) - 1, q + 1);
+		if (k > 0)
+		{
+			out.put(u & ((1u << k) - 1), k);
+		}
+	}
+	else
+	{
+		out.put((1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+		out.put(u, 32);
+	}
+}
+
+static uint32_t getRice(BitReader& in, int k)
+{
+	uint32_t q = 0;
+	while (q < RICE_ESCAPE && in.get(1) != 0)
+	{
+		q++;
+	}
+	if (q == RICE_ESCAPE)
+	{
+		return in.get(32);
+	}
+	return k > 0 ? (q << k) | in.get(k) : q;
+}
+
+
+// history_frames previous frames may be predicted from (0 for a keyframe)
+static void encodeFrame(const QuantisedFrame& frame, const QuantisedFrame history[2], int history_frames, std::vector<uint8_t>& payload)
+{
+	BitWriter out(payload);
+	int n = frame.particles;
+	int predictors = 1 + std::min(history_frames, 2);
+
+	for (int c = 0; c < FRAME_CHANNELS; c++)
+	{
+		const uint32_t* values = &frame.values[(size_t)c * n];
+		const uint32_t* previous = history_frames > 0 ? &history[0].values[(size_t)c * n] : NULL;
+		const uint32_t* before = history_frames > 1 ? &history[1].values[(size_t)c * n] : NULL;
+
+		for (int begin = 0; begin < n; begin += FRAME_CODEC_BLOCK)
+		{
+			int end = std::min(begin + FRAME_CODEC_BLOCK, n);
+
+			// Keep the predictor that codes the block smallest
+			int best = PREDICT_PARTICLE, best_k = 0;
+			uint64_t best_cost = ~0ull;
+			for (int p = 0; p < predictors; p++)
+			{
+				uint64_t sum = 0, cost;
+				for (int i = begin; i < end; i++)
+				{
+					sum += zigzag(values[i] - predict(p, values, previous, before, i));
+				}
+				int k = riceParameter(sum, end - begin, cost);
+				if (cost < best_cost)
+				{
+					best = p;
+					best_k = k;
+					best_cost = cost;
+				}
+			}
+
+			out.put(best, 2);
+			out.put(best_k, 5);
+			for (int i = begin; i < end; i++)
+			{
+				putRice(out, zigzag(values[i] - predict(best, values, previous, before, i)), best_k);
+			}
+		}
+	}
+
+	out.flush();
+}
+
+static bool decodeFrame(const std::vector<uint8_t>& payload, const QuantisedFrame history[2], int history_frames, QuantisedFrame& frame)
+{
+	BitReader in(payload);
+	int n = frame.particles;
+	frame.values.resize((size_t)FRAME_CHANNELS * n);
+
+	for (int c = 0; c < FRAME_CHANNELS; c++)
+	{
+		uint32_t* values = &frame.values[(size_t)c * n];
+		const uint32_t* previous = history_frames > 0 ? &history[0].values[(size_t)c * n] : NULL;
+		const uint32_t* before = history_frames > 1 ? &history[1].values[(size_t)c * n] : NULL;
+
+		for (int begin = 0; begin < n; begin += FRAME_CODEC_BLOCK)
+		{
+			int end = std::min(begin + FRAME_CODEC_BLOCK, n);
+			int predictor = (int)in.get(2), k = (int)in.get(5);
+			if (predictor > std::min(history_frames, 2))
+			{
+				return false;
+			}
+
+			for (int i = begin; i < end; i++)
+			{
+				values[i] = predict(predictor, values, previous, before, i) + unzigzag(getRice(in, k));
+			}
+			if (in.overrun)
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+static uint32_t positionLimit(const FrameStreamHeader& header)
+{
+	return (uint32_t)((1ull << header.position_bits) - 1);
+}
+
+static uint32_t quantiseStep(double value, double step)
+{
+	return (uint32_t)(int32_t)floor(value / step + 0.5);
+}
+
+FrameEncoder::FrameEncoder(const char* path, const FrameCodecSettings& settings, const double origin[3], const double extent[3]) :
+	frames(0), raw_bytes(0), encoded_bytes(0), max_position_error(0),
+	offset(0),
+	history_frames(0)
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STREAM_MAGIC, sizeof(header.magic));
+	header.version = FRAME_STREAM_VERSION;
+	header.position_bits = std::max(1, std::min(settings.position_bits, FRAME_MAX_POSITION_BITS));
+	header.key_interval = std::max(1, settings.key_interval);
+	header.block_size = FRAME_CODEC_BLOCK;
+	for (int d = 0; d < 3; d++)
+	{
+		header.origin[d] = origin[d];
+		header.extent[d] = extent[d];
+	}
+	header.velocity_step = settings.velocity_step;
+	header.density_step = settings.density_step;
+	header.volume_step = settings.volume_step;
+
+	file = fopen(path, "wb");
+	if (file != NULL && fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		fclose(file);
+		file = NULL;
+	}
+	offset = sizeof(header);
+}
+
+FrameEncoder::~FrameEncoder()
+{
+	close();
+}
+
+bool FrameEncoder::encode(int step, double time, int particles,
+	const float* position, const float* velocity, const float* density, const float* volume)
+{
+	if (file == NULL || particles < 0)
+	{
+		return false;
+	}
+
+	// Quantise; positions are clamped to the box
+	int n = particles;
+	uint32_t limit = positionLimit(header);
+	current.particles = n;
+	current.values.resize((size_t)FRAME_CHANNELS * n);
+	for (int d = 0; d < 3; d++)
+	{
+		double scale = limit / header.extent[d];
+		uint32_t* qp = &current.values[(size_t)d * n];
+		uint32_t* qv = &current.values[(size_t)(3 + d) * n];
+		for (int i = 0; i < n; i++)
+		{
+			double x = (position[3 * i + d] - header.origin[d]) * scale;
+			x = std::max(0.0, std::min(x, (double)limit));
+			qp[i] = (uint32_t)floor(x + 0.5);
+			max_position_error = std::max(max_position_error,
+				fabs(header.origin[d] + qp[i] / scale - position[3 * i + d]));
+
+			qv[i] = quantiseStep(velocity[3 * i + d], header.velocity_step);
+		}
+	}
+	uint32_t* qd = &current.values[(size_t)6 * n];
+	uint32_t* qw = &current.values[(size_t)7 * n];
+	for (int i = 0; i < n; i++)
+	{
+		qd[i] = quantiseStep(density[i], header.density_step);
+		qw[i] = quantiseStep(volume[i], header.volume_step);
+	}
+
+	// Prediction restarts at keyframes, and whenever the particle count changes
+	bool keyframe = frames % header.key_interval == 0 || history_frames == 0 || history[0].particles != n;
+	if (keyframe)
+	{
+		history_frames = 0;
+	}
+	encodeFrame(current, history, history_frames, payload);
+
+	FrameRecord record;
+	memset(&record, 0, sizeof(record));
+	memcpy(record.magic, RECORD_MAGIC, sizeof(record.magic));
+	record.step = step;
+	record.time = time;
+	record.particles = n;
+	record.keyframe = keyframe;
+	record.bytes = payload.size();
+	if (fwrite(&record, sizeof(record), 1, file) != 1
+		|| (!payload.empty() && fwrite(payload.data(), 1, payload.size(), file) != payload.size()))
+	{
+		return false;
+	}
+
+	FrameIndexEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.step = step;
+	entry.keyframe = keyframe;
+	entry.time = time;
+	entry.offset = offset;
+	index.push_back(entry);
+	offset += sizeof(record) + payload.size();
+
+	std::swap(history[1], history[0]);
+	std::swap(history[0], current);
+	history_frames = std::min(history_frames + 1, 2);
+
+	frames++;
+	raw_bytes += (uint64_t)n * 8 * sizeof(float);
+	encoded_bytes += sizeof(record) + payload.size();
+	return true;
+}
+
+bool FrameEncoder::close()
+{
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	FrameIndexTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.offset = offset;
+	trailer.frames = (int32_t)index.size();
+	memcpy(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic));
+
+	bool ok = (index.empty() || fwrite(index.data(), sizeof(FrameIndexEntry), index.size(), file) == index.size())
+		&& fwrite(&trailer, sizeof(trailer), 1, file) == 1;
+	ok = fclose(file) == 0 && ok;
+	file = NULL;
+	return ok;
+}
+
+
+FrameDecoder::FrameDecoder(const char* path) :
+	decoded(-1),
+	history_frames(0)
+{
+	file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1
+		|| memcmp(header.magic, STREAM_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != FRAME_STREAM_VERSION
+		|| header.block_size != FRAME_CODEC_BLOCK
+		|| header.position_bits < 1 || header.position_bits > FRAME_MAX_POSITION_BITS)
+	{
+		fclose(file);
+		file = NULL;
+		return;
+	}
+
+	if (!readIndex())
+	{
+		scanRecords();
+	}
+}
+
+FrameDecoder::~FrameDecoder()
+{
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+}
+
+bool FrameDecoder::readIndex()
+{
+	uint64_t size = fileSize(file);
+	FrameIndexTrailer trailer;
+	if (size < sizeof(header) + sizeof(trailer)
+		|| !seekTo(file, size - sizeof(trailer))
+		|| fread(&trailer, sizeof(trailer), 1, file) != 1
+		|| memcmp(trailer.magic, INDEX_MAGIC, sizeof(trailer.magic)) != 0
+		|| trailer.frames < 0
+		|| trailer.offset + (uint64_t)trailer.frames * sizeof(FrameIndexEntry) + sizeof(trailer) != size)
+	{
+		return false;
+	}
+
+	index.resize(trailer.frames);
+	if (!seekTo(file, trailer.offset)
+		|| (trailer.frames > 0 && fread(index.data(), sizeof(FrameIndexEntry), index.size(), file) != index.size()))
+	{
+		index.clear();
+		return false;
+	}
+	return true;
+}
+
+// Rebuild the index of a stream that was never closed, up to its last complete frame
+void FrameDecoder::scanRecords()
+{
+	index.clear();
+	uint64_t size = fileSize(file), offset = sizeof(header);
+	FrameRecord record;
+
+	while (seekTo(file, offset) && fread(&record, sizeof(record), 1, file) == 1
+		&& memcmp(record.magic, RECORD_MAGIC, sizeof(record.magic)) == 0
+		&& record.bytes <= size - offset - sizeof(record))
+	{
+		FrameIndexEntry entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.step = record.step;
+		entry.keyframe = record.keyframe;
+		entry.time = record.time;
+		entry.offset = offset;
+		index.push_back(entry);
+		offset += sizeof(record) + record.bytes;
+	}
+}
+
+bool FrameDecoder::decodeNext(int frame)
+{
+	FrameRecord record;
+	if (!seekTo(file, index[frame].offset)
+		|| fread(&record, sizeof(record), 1, file) != 1
+		|| memcmp(record.magic, RECORD_MAGIC, sizeof(record.magic)) != 0
+		|| record.particles < 0)
+	{
+		return false;
+	}
+
+	payload.resize((size_t)record.bytes);
+	if (!payload.empty() && fread(payload.data(), 1, payload.size(), file) != payload.size())
+	{
+		return false;
+	}
+
+	if (record.keyframe)
+	{
+		history_frames = 0;
+	}
+	else if (history_frames == 0 || history[0].particles != record.particles)
+	{
+		return false;
+	}
+
+	current.particles = record.particles;
+	if (!decodeFrame(payload, history, history_frames, current))
+	{
+		return false;
+	}
+
+	std::swap(history[1], history[0]);
+	std::swap(history[0], current);
+	history_frames = std::min(history_frames + 1, 2);
+	decoded = frame;
+	return true;
+}
+
+bool FrameDecoder::decode(int frame, std::vector<float>& position, std::vector<float>& velocity,
+	std::vector<float>& density, std::vector<float>& volume)
+{
+	if (file == NULL || frame < 0 || frame >= (int)index.size())
+	{
+		return false;
+	}
+
+	// Carry on from the last decoded frame if it is on the way, otherwise restart at the keyframe
+	int key = frame;
+	while (key >= 0 && !index[key].keyframe)
+	{
+		key--;
+	}
+	if (key < 0)
+	{
+		return false;
+	}
+	int next = decoded >= key && decoded <= frame ? decoded + 1 : key;
+	for (int f = next; f <= frame; f++)
+	{
+		if (!decodeNext(f))
+		{
+			decoded = -1;
+			return false;
+		}
+	}
+
+	const QuantisedFrame& q = history[0];
+	int n = q.particles;
+	uint32_t limit = positionLimit(header);
+	position.resize(3 * (size_t)n);
+	velocity.resize(3 * (size_t)n);
+	density.resize(n);
+	volume.resize(n);
+	for (int d = 0; d < 3; d++)
+	{
+		double scale = header.extent[d] / limit;
+		const uint32_t* qp = &q.values[(size_t)d * n];
+		const uint32_t* qv = &q.values[(size_t)(3 + d) * n];
+		for (int i = 0; i < n; i++)
+		{
+			position[3 * i + d] = (float)(header.origin[d] + qp[i] * scale);
+			velocity[3 * i + d] = (float)((int32_t)qv[i] * header.velocity_step);
+		}
+	}
+	for (int i = 0; i < n; i++)
+	{
+		density[i] = (float)((int32_t)q.values[(size_t)6 * n + i] * header.density_step);
+		volume[i] = (float)((int32_t)q.values[(size_t)7 * n + i] * header.volume_step);
+	}
+
+	return true;
+}
\ No newline at end of file
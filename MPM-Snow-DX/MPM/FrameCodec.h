@@ -0,0 +1,161 @@
+#pragma once
+#ifndef FRAMECODEC_H
+#define FRAMECODEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+// Compressed stream of particle frames (positions, velocities, density, volume)
+//
+// Every field is quantised to integers with a fixed step, so the error is bounded by half a step:
+//   positions: position_bits per axis across the grid
+//   velocity, density, volume: velocity_step, density_step, volume_step
+// Each field channel is split into blocks of FRAME_CODEC_BLOCK particles; a block picks the predictor
+// that suits it best (the previous particle, the previous frame, or linear extrapolation from the last
+// two frames) and Rice codes the residuals. Frames only predict from earlier frames back to the last
+// keyframe, written every key_interval frames
+//
+// Layout (little-endian):
+//   FrameStreamHeader
+//   one FrameRecord and its payload per frame
+//   FrameIndexEntry per frame, then FrameIndexTrailer
+// A stream cut short has no index; the decoder rebuilds it from the records
+const uint32_t FRAME_STREAM_VERSION = 1;
+const int FRAME_CODEC_BLOCK = 256;
+const int FRAME_CHANNELS = 8;		// Position and velocity axes, density, volume
+const int FRAME_MAX_POSITION_BITS = 31;	// Quantised positions must fit a signed 32-bit residual
+
+struct FrameStreamHeader
+{
+	char magic[8];				// "MPMZSTRM"
+	uint32_t version;
+	int32_t position_bits;
+	int32_t key_interval;
+	int32_t block_size;
+	// Quantisation range of the positions, usually the grid
+	double origin[3], extent[3];
+	double velocity_step, density_step, volume_step;
+};
+
+struct FrameRecord
+{
+	char magic[4];				// "MPMZ"
+	int32_t step;
+	double time;
+	int32_t particles;
+	uint32_t keyframe;
+	uint64_t bytes;				// Payload that follows the record
+};
+
+struct FrameIndexEntry
+{
+	int32_t step;
+	uint32_t keyframe;
+	double time;
+	uint64_t offset;			// Of the frame's FrameRecord
+};
+
+struct FrameIndexTrailer
+{
+	uint64_t offset;			// Of the first FrameIndexEntry
+	int32_t frames;
+	char magic[4];				// "MPMI"
+};
+
+// Precision and keyframe spacing of a stream
+struct FrameCodecSettings
+{
+	int position_bits;			// 16 or 21 are the usual choices
+	int key_interval;
+	double velocity_step, density_step;
+	double volume_step;			// 0 lets FrameExporter derive it from the configured particle diameter
+
+	// Defaults from SimulationParameters
+	FrameCodecSettings();
+};
+
+// Quantised fields of one frame, channel by channel
+struct QuantisedFrame
+{
+	int particles;
+	std::vector<uint32_t> values;	// values[channel * particles + i]
+
+	QuantisedFrame() : particles(0) {}
+};
+
+class FrameEncoder
+{
+public:
+	// Positions are quantised across the box [origin, origin + extent]
+	FrameEncoder(const char* path, const FrameCodecSettings& settings, const double origin[3], const double extent[3]);
+	// Owns its file, so it cannot be copied
+	FrameEncoder(const FrameEncoder&) = delete;
+	FrameEncoder& operator=(const FrameEncoder&) = delete;
+	// Writes the index if close() was not called
+	virtual ~FrameEncoder();
+
+	bool isOpen() const { return file != NULL; }
+
+	// Append a frame; position and velocity hold 3 floats per particle
+	bool encode(int step, double time, int particles,
+		const float* position, const float* velocity, const float* density, const float* volume);
+
+	// Write the index and close the stream
+	bool close();
+
+	// Frames written, and their size as float fields against the encoded stream
+	int frames;
+	uint64_t raw_bytes, encoded_bytes;
+	// Largest quantisation error of a position coordinate so far
+	double max_position_error;
+
+private:
+	FILE* file;
+	FrameStreamHeader header;
+	std::vector<FrameIndexEntry> index;
+	uint64_t offset;
+
+	// Last two frames since the keyframe, for the temporal predictors
+	QuantisedFrame current, history[2];
+	int history_frames;
+	std::vector<uint8_t> payload;
+};
+
+class FrameDecoder
+{
+public:
+	FrameDecoder(const char* path);
+	// Owns its file, so it cannot be copied
+	FrameDecoder(const FrameDecoder&) = delete;
+	FrameDecoder& operator=(const FrameDecoder&) = delete;
+	virtual ~FrameDecoder();
+
+	bool isOpen() const { return file != NULL; }
+
+	FrameStreamHeader header;
+
+	int frameCount() const { return (int)index.size(); }
+	const FrameIndexEntry& entry(int frame) const { return index[frame]; }
+
+	// Decode any frame; decodes forward from the nearest keyframe, so reading in order is cheapest
+	// position and velocity get 3 floats per particle
+	bool decode(int frame, std::vector<float>& position, std::vector<float>& velocity,
+		std::vector<float>& density, std::vector<float>& volume);
+
+private:
+	FILE* file;
+	std::vector<FrameIndexEntry> index;
+
+	// Last decoded frame and the one before it, and how many frames since its keyframe they cover
+	int decoded;
+	QuantisedFrame current, history[2];
+	int history_frames;
+	std::vector<uint8_t> payload;
+
+	bool readIndex();
+	void scanRecords();
+	bool decodeNext(int frame);
+};
+
+#endif // !FRAMECODEC_H
\ No newline at end of file
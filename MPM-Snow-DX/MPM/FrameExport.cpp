@@ -0,0 +1,253 @@
+#include "FrameExport.h"
+#include "Simulator.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char FRAME_MAGIC[8] = { 'M', 'P', 'M', 'F', 'R', 'A', 'M', 'E' };
+
+FrameExporter::FrameExporter(const char* prefix, int formats, int ring_size) :
+	written(0), dropped(0), failed(0),
+	encoder(NULL),
+	prefix(prefix),
+	formats(formats),
+	ring(ring_size > 0 ? ring_size : 1),
+	head(0), tail(0), queued(0),
+	stopping(false)
+{
+	thread = std::thread(&FrameExporter::writerLoop, this);
+}
+
+FrameExporter::~FrameExporter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	signal.notify_all();
+	thread.join();
+
+	// Writes the stream index
+	delete encoder;
+}
+
+bool FrameExporter::snapshot(const Simulator& simulator)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (queued == (int)ring.size())
+		{
+			dropped++;
+			return false;
+		}
+	}
+
+	// The writer never touches a slot that is not queued, so it is filled without the lock
+	Frame& frame = ring[head];
+	const ParticleArrays& p = simulator.point_cloud->particles;
+	int n = p.size();
+	frame.step = simulator.step;
+	frame.time = simulator.time;
+	frame.particles = n;
+	const Grid* grid = simulator.grid;
+	for (int d = 0; d < 3; d++)
+	{
+		frame.origin[d] = grid->origin[d];
+		frame.extent[d] = (grid->size[d] - 1) * grid->cellsize[d];
+	}
+	double diameter = simulator.config.particle_diameter;
+	frame.particle_volume = diameter * diameter * diameter;
+	// Buffers only grow, so steady-state frames do not allocate
+	if ((int)frame.density.size() < n)
+	{
+		frame.position.resize(3 * (size_t)n);
+		frame.velocity.resize(3 * (size_t)n);
+		frame.density.resize(n);
+		frame.volume.resize(n);
+	}
+
+	simulator.thread_pool->parallelFor(n, [&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+		{
+			// Undo the Morton sort, so particles keep their place from frame to frame
+			int j = p.id[i];
+			for (int k = 0; k < 3; k++)
+			{
+				frame.position[3 * j + k] = (float)p.position[i](k);
+				frame.velocity[3 * j + k] = (float)p.velocity[i](k);
+			}
+			frame.density[j] = (float)p.density[i];
+			frame.volume[j] = (float)p.volume[i];
+		}
+	});
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		head = (head + 1) % (int)ring.size();
+		queued++;
+	}
+	signal.notify_all();
+	return true;
+}
+
+void FrameExporter::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	signal.wait(lock, [this] { return queued == 0; });
+}
+
+void FrameExporter::writerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		// Queued frames are written before stopping
+		signal.wait(lock, [this] { return queued > 0 || stopping; });
+		if (queued == 0)
+		{
+			return;
+		}
+		const Frame& frame = ring[tail];
+
+		lock.unlock();
+		bool ok = true;
+		if (formats & FRAME_BINARY)
+		{
+			ok = writeBinary(frame, framePath(frame, ".frame")) && ok;
+		}
+		if (formats & FRAME_PLY)
+		{
+			ok = writePly(frame, framePath(frame, ".ply")) && ok;
+		}
+		if (formats & FRAME_COMPRESSED)
+		{
+			ok = writeCompressed(frame) && ok;
+		}
+		lock.lock();
+
+		if (ok) written++;
+		else failed++;
+		tail = (tail + 1) % (int)ring.size();
+		queued--;
+		signal.notify_all();
+	}
+}
+
+std::string FrameExporter::framePath(const Frame& frame, const char* extension) const
+{
+	char number[16];
+	snprintf(number, sizeof(number), "%06d", frame.step);
+	return prefix + number + extension;
+}
+
+// Frames are written to a temporary and renamed once complete, so a renderer
+// watching the directory never picks up half a frame
+static FILE* openTemporary(const std::string& path)
+{
+	return fopen((path + ".tmp").c_str(), "wb");
+}
+
+static bool finishTemporary(FILE* file, const std::string& path, bool ok)
+{
+	std::string temporary = path + ".tmp";
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	remove(path.c_str());
+#endif
+	return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool FrameExporter::writeBinary(const Frame& frame, const std::string& path)
+{
+	FILE* file = openTemporary(path);
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	FrameHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FRAME_MAGIC, sizeof(header.magic));
+	header.version = FRAME_VERSION;
+	header.step = frame.step;
+	header.time = frame.time;
+	header.particles = frame.particles;
+	header.chunk_size = FRAME_CHUNK_SIZE;
+	header.chunk_count = (frame.particles + FRAME_CHUNK_SIZE - 1) / FRAME_CHUNK_SIZE;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	for (int first = 0; ok && first < frame.particles; first += FRAME_CHUNK_SIZE)
+	{
+		FrameChunk chunk;
+		chunk.first = first;
+		chunk.count = frame.particles - first < FRAME_CHUNK_SIZE ? frame.particles - first : FRAME_CHUNK_SIZE;
+		size_t n = chunk.count;
+
+		ok = fwrite(&chunk, sizeof(chunk), 1, file) == 1
+			&& fwrite(&frame.position[3 * (size_t)first], sizeof(float), 3 * n, file) == 3 * n
+			&& fwrite(&frame.velocity[3 * (size_t)first], sizeof(float), 3 * n, file) == 3 * n
+			&& fwrite(&frame.density[first], sizeof(float), n, file) == n
+			&& fwrite(&frame.volume[first], sizeof(float), n, file) == n;
+	}
+
+	return finishTemporary(file, path, ok);
+}
+
+bool FrameExporter::writePly(const Frame& frame, const std::string& path)
+{
+	FILE* file = openTemporary(path);
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	bool ok = fprintf(file,
+		"ply\n"
+		"format binary_little_endian 1.0\n"
+		"comment step %d time %.9g\n"
+		"element vertex %d\n"
+		"property float x\nproperty float y\nproperty float z\n"
+		"property float vx\nproperty float vy\nproperty float vz\n"
+		"property float density\nproperty float volume\n"
+		"end_header\n", frame.step, frame.time, frame.particles) > 0;
+
+	// Interleave one chunk of vertices at a time
+	const int stride = 8;
+	vertices.resize((size_t)FRAME_CHUNK_SIZE * stride);
+	for (int first = 0; ok && first < frame.particles; first += FRAME_CHUNK_SIZE)
+	{
+		int count = frame.particles - first < FRAME_CHUNK_SIZE ? frame.particles - first : FRAME_CHUNK_SIZE;
+		for (int j = 0; j < count; j++)
+		{
+			size_t i = (size_t)(first + j);
+			float* v = &vertices[(size_t)j * stride];
+			v[0] = frame.position[3 * i]; v[1] = frame.position[3 * i + 1]; v[2] = frame.position[3 * i + 2];
+			v[3] = frame.velocity[3 * i]; v[4] = frame.velocity[3 * i + 1]; v[5] = frame.velocity[3 * i + 2];
+			v[6] = frame.density[i];
+			v[7] = frame.volume[i];
+		}
+		ok = fwrite(vertices.data(), sizeof(float) * stride, count, file) == (size_t)count;
+	}
+
+	return finishTemporary(file, path, ok);
+}
+
+bool FrameExporter::writeCompressed(const Frame& frame)
+{
+	if (encoder == NULL)
+	{
+		FrameCodecSettings settings = codec;
+		if (settings.volume_step <= 0)
+		{
+			settings.volume_step = EXPORT_VOLUME_STEP * frame.particle_volume;
+		}
+		encoder = new FrameEncoder((prefix + ".mpmz").c_str(), settings, frame.origin, frame.extent);
+	}
+	return encoder->encode(frame.step, frame.time, frame.particles,
+		frame.position.data(), frame.velocity.data(), frame.density.data(), frame.volume.data());
+}
\ No newline at end of file
@@ -0,0 +1,117 @@
+#pragma once
+#ifndef FRAMEEXPORT_H
+#define FRAMEEXPORT_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "FrameCodec.h"
+
+class Simulator;
+
+// Per-frame particle output for offline rendering
+//
+// Binary frame layout (little-endian, prefix + step + ".frame"):
+//   FrameHeader
+//   chunk_count chunks, each:
+//     FrameChunk
+//     position[count][3], velocity[count][3], density[count], volume[count] as float
+//
+// Chunks hold up to chunk_size particles, so readers can stream a frame or pick out part of it
+// PLY frames (prefix + step + ".ply") hold the same fields interleaved per vertex
+// Compressed frames all go to one stream, prefix + ".mpmz" (see FrameCodec)
+// Particles are always written in creation order, however the simulation has sorted them
+const uint32_t FRAME_VERSION = 1;
+const int FRAME_CHUNK_SIZE = 65536;
+
+// Output formats, combined as flags
+const int FRAME_BINARY = 1;
+const int FRAME_PLY = 2;
+const int FRAME_COMPRESSED = 4;
+
+struct FrameHeader
+{
+	char magic[8];				// "MPMFRAME"
+	uint32_t version;
+	int32_t step;
+	double time;
+	int32_t particles;
+	int32_t chunk_size;
+	int32_t chunk_count;
+	uint32_t reserved;
+};
+
+struct FrameChunk
+{
+	int32_t first;				// Index of the chunk's first particle in the frame
+	int32_t count;
+};
+
+// Copies frames into a ring of preallocated buffers and writes them on a background thread
+// The simulation only pays for the copy; a frame requested while every buffer is still waiting
+// to be written is dropped and counted, so a slow disk never stalls the run
+class FrameExporter
+{
+public:
+	// Frames go to prefix + zero-padded step + extension
+	FrameExporter(const char* prefix, int formats = FRAME_BINARY, int ring_size = 4);
+	// Owns its writer thread, so it cannot be copied
+	FrameExporter(const FrameExporter&) = delete;
+	FrameExporter& operator=(const FrameExporter&) = delete;
+	virtual ~FrameExporter();
+
+	// Copy the current particles into a free buffer; returns false if the frame was dropped
+	bool snapshot(const Simulator& simulator);
+
+	// Block until every queued frame is on disk
+	void wait();
+
+	// Frames written, dropped and failed so far
+	int written, dropped, failed;
+
+	// Precision of the compressed stream; only read when the first frame is written
+	FrameCodecSettings codec;
+	// Compressed stream, once a frame has been written to it; NULL otherwise
+	FrameEncoder* encoder;
+
+private:
+	// One buffered frame, in the exported precision
+	struct Frame
+	{
+		int step;
+		double time;
+		int particles;
+		// Grid box, the quantisation range of compressed positions
+		double origin[3], extent[3];
+		// Of one particle at the configured diameter, the scale of the compressed volumes
+		double particle_volume;
+		std::vector<float> position, velocity, density, volume;
+	};
+
+	std::string prefix;
+	int formats;
+
+	// Ring of frames: the simulation fills slot head, the writer drains slot tail
+	std::vector<Frame> ring;
+	int head, tail, queued;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable signal;
+	bool stopping;
+
+	// Writer thread scratch for interleaving PLY vertices
+	std::vector<float> vertices;
+
+	void writerLoop();
+	bool writeBinary(const Frame& frame, const std::string& path);
+	bool writePly(const Frame& frame, const std::string& path);
+	bool writeCompressed(const Frame& frame);
+	std::string framePath(const Frame& frame, const char* extension) const;
+};
+
+#endif // !FRAMEEXPORT_H
\ No newline at end of file
@@ -1,91 +1,115 @@
-#include "pch.h"
 #include "Grid.h"
 
-Grid::Grid(Eigen::Vector3d pos, Eigen::Vector3d dims, Eigen::Vector3d cells, PointCloud* object)
+Grid::Grid(const SimulationConfig& config, PointCloud* object)
 {
 	point_cloud = object;
-	origin = pos;
-	cellsize = division(dims, cells);
-	size = add_const(cells, 1);
-	nodes_length = product(size);
-	nodes = new GridNode[nodes_length];
+	origin = config.origin.cast<Real>();
+	cellsize = division(config.dims, config.cells).cast<Real>();
+	size = add_const(config.cells, 1).cast<Real>();
 	node_volume = product(cellsize);
-	
-	// APIC: initialize grid node position
-	nodes_position = new Eigen::Vector3d[nodes_length];
-	for (int y = 0, idx = 0; y < size[1]; y++)
+	thread_pool = NULL;
+
+	// APIC: D^-1 = scale/h^2 on each axis
+	kernel = config.kernel;
+	closed_form_inertia = config.closed_form_inertia;
+	inertia_inverse.setZero();
+	for (int i = 0; i < 3; i++)
 	{
-		for (int z = 0; z < size[2]; z++)
-		{
-			for (int x = 0; x < size[0]; x++, idx++)
-			{
-				nodes_position[idx] = Eigen::Vector3d(
-					x * cellsize(0) + cellsize(0) / 2.0,
-					y * cellsize(1) + cellsize(1) / 2.0,
-					z * cellsize(2) + cellsize(2) / 2.0);
-			}
-		}
+		inertia_inverse(i, i) = inertiaScale(kernel) / (cellsize(i) * cellsize(i));
 	}
+	mls_transfer = config.mls_transfer;
+	implicit_solve = config.implicit_solve;
+	implicit_ratio = config.implicit_ratio;
+	implicit_tolerance = config.implicit_tolerance;
+	max_implicit_iterations = config.implicit_iterations;
+	implicit_iterations = 0;
+	sticky = config.sticky;
+
+	// Block table covers the whole domain; node storage is only allocated where particles live
+	for (int i = 0; i < 3; i++)
+	{
+		blocks_size[i] = ((int)size[i] + GRID_BLOCK - 1) / GRID_BLOCK;
+	}
+	int num_blocks = blocks_size[0] * blocks_size[1] * blocks_size[2];
+	block_table.assign(num_blocks, -1);
+	block_particles.assign(num_blocks, 0);
+	block_count = 0;
+	stray_particles = 0;
 }
 
 // Copy constructor
 Grid::Grid(const Grid& orig) {}
 
-Grid::~Grid()
-{
-	delete[] nodes;
-	delete[] nodes_position;
-}
+Grid::~Grid() {}
 
 // Maps mass to the grid
 void Grid::initializeMass()
 {
 	// Reset the grid
-	// If the grid is sparsely filled, it may be better to reset individual nodes
-	memset(nodes, 0, sizeof(GridNode)*nodes_length);
+	// Only blocks around the particles are allocated and cleared
+	binParticles();
+	allocateBlocks();
 
-	// Map particle data to grid
-	for (int i = 0; i < point_cloud->size; i++)
-	{
-		Particle& p = point_cloud->particles[i];
-		// Particle position to grid coordinates
-		// This will give errors if the particle is outside the grid bounds
-		p.grid_position = division(p.position - origin, cellsize);
-		double ox = p.grid_position[0], oy = p.grid_position[1], oz = p.grid_position[2];
+	dispatchKernel(kernel, [this](auto k) {
+		typedef decltype(k) K;
 
-		// Shape function gives a blending radius of two;
-		// so we do computations within a 2x2x2 cube for each particle
-		for (int idx = 0, y = oy - 1, y_end = y + 3; y <= y_end; y++)
-		{
-			// Y-dimension interpolation
-			double y_pos = oy - y,
-				wy = Grid::B_Spline(y_pos),
-				dy = Grid::B_SplineSlope(y_pos);
+		// Weights only touch their own particle
+		forEachParticle([this](int i) { computeWeights<K>(i); });
 
-			for (int z = oz - 1, z_end = z + 3; z <= z_end; z++)
-			{
-				// Z-dimension interpolation
-				double z_pos = oz - z,
-					wz = Grid::B_Spline(z_pos),
-					dz = Grid::B_SplineSlope(z_pos);
+		scatterColored([this](int i) { scatterMass<K>(i); });
+	});
+}
 
-				for (int x = ox - 1, x_end = x + 3; x <= x_end; x++, idx++)
-				{
-					// X-dimension interpolation
-					double x_pos = ox - x,
-						wx = Grid::B_Spline(x_pos),
-						dx = Grid::B_SplineSlope(x_pos);
+// Compute grid position and interpolation weights of a particle
+// Only the one-dimensional weights are stored; stencil weights are their tensor products
+template <class K>
+void Grid::computeWeights(int i) const
+{
+	ParticleArrays& p = point_cloud->particles;
+	SplineWeights& weights = p.spline_weights[i];
+	SplineWeights& slopes = p.spline_slopes[i];
+
+	// Particle position to grid coordinates
+	// This will give errors if the particle is outside the grid bounds
+	p.grid_position[i] = division(p.position[i] - origin, cellsize);
+
+	// Shape function gives a blending radius of K::WIDTH / 2;
+	// so we do computations within a K::WIDTH^3 cube for each particle
+	for (int d = 0; d < 3; d++)
+	{
+		Real o = p.grid_position[i][d];
+		for (int j = 0, n = K::base(o); j < K::WIDTH; j++, n++)
+		{
+			Real pos = o - n;
+			weights(d, j) = K::weight(pos);
+			// Slopes are stored in world units, ready for the weight gradient
+			// MLS-MPM only needs them for the implicit solve
+			if (!mls_transfer || implicit_solve)
+			{
+				slopes(d, j) = K::slope(pos) / cellsize(d);
+			}
+		}
+	}
+}
 
-					// Final weight is dyadic product of weights in each dimension
-					double weight = wx * wy * wz;
-					p.weights[idx] = weight;
+// Interpolate particle mass onto its stencil
+template <class K>
+void Grid::scatterMass(int i)
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
 
-					// Weight gradient is a vector of partial derivatives
-					setData(p.weight_gradient[idx], dx*wy*wz / cellsize(0), dy*wx*wz / cellsize(1), dz*wx*wz / cellsize(2));
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
 
-					// Interpolate mass
-					nodes[(int)(y*size[0]*size[2] + z*size[0] + x)].mass += weight * p.mass;
-				}
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
+		{
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
+			{
+				nodeAt(x, y, z).mass += nodeWeight(weights, l, j, k) * p.mass[i];
 			}
 		}
 	}
@@ -94,78 +118,181 @@ void Grid::initializeMass()
 // APIC: initialize the inertia-like tensor matrix D(n, p) in the particles
 void Grid::initializeInertiaTensor()
 {
-	for (int i = 0; i < point_cloud->size; i++)
+	// Nothing to accumulate when the analytic inverse is used
+	if (closed_form_inertia)
 	{
-		Particle& p = point_cloud->particles[i];
+		return;
+	}
 
-		p.inertia_tensor_reverse.setZero();
+	dispatchKernel(kernel, [this](auto k) {
+		typedef decltype(k) K;
+		forEachParticle([this](int i) { computeInertiaTensor<K>(i); });
+	});
+}
 
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1],
-			oz = p.grid_position[2];
+template <class K>
+void Grid::computeInertiaTensor(int i)
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
 
-		for (int idx = 0, y = oy - 1, y_end = y + 3; y <= y_end; y++)
+	p.inertia_tensor_reverse[i].setZero();
+
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			for (int z = oz - 1, z_end = z + 3; z <= z_end; z++)
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
 			{
-				for (int x = ox - 1, x_end = x + 3; x <= x_end; x++, idx++)
+				Real w = nodeWeight(weights, l, j, k);
+				if (w > BSPLINE_EPSILON)
 				{
-					double w = p.weights[idx];
-					if (w > BSPLINE_EPSILON)
-					{
-						int n = y * size[0] * size[2] + z * size[0] + x;
-						p.inertia_tensor_reverse += w * (nodes_position[n] - p.position) * ((nodes_position[n] - p.position).transpose());
-					}
+					Vector3r offset = nodePosition(x, y, z) - p.position[i];
+					p.inertia_tensor_reverse[i] += w * offset * offset.transpose();
 				}
 			}
 		}
-
-		// Save the reverse result
-		p.inertia_tensor_reverse.reverseInPlace();
 	}
+
+	// Save the inverse
+	p.inertia_tensor_reverse[i] = p.inertia_tensor_reverse[i].inverse().eval();
 }
 
-// Maps velocity to the grid
-void Grid::initializeVelocities()
+// Fused particle-to-grid transfer
+// Does the work of initializeMass, initializeInertiaTensor and initializeVelocities
+// with a single sweep over particle memory
+void Grid::particleToGrid(double dt)
 {
-	// Interpolate velocity after mass, to conserve momentum
-	for (int i = 0; i < point_cloud->size; i++)
+	// Binning only needs positions, so it can run before the weights
+	binParticles();
+	allocateBlocks();
+
+	dispatchKernel(kernel, [this, dt](auto k) {
+		typedef decltype(k) K;
+		scatterColored([this, dt](int i) { scatterParticle<K>(i, dt); });
+	});
+
+	normalizeVelocities(dt);
+}
+
+// Weights, inertia tensor, mass and momentum of one particle, while its data is in cache
+template <class K>
+void Grid::scatterParticle(int i, double dt)
+{
+	computeWeights<K>(i);
+	if (!closed_form_inertia)
 	{
-		Particle& p = point_cloud->particles[i];
+		computeInertiaTensor<K>(i);
+	}
+
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
 
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1],
-			oz = p.grid_position[2];
+	// The affine momentum field is constant for this particle
+	Matrix3r affine = affineMomentum(i, dt);
+	Real mass = p.mass[i];
+	Vector3r momentum = mass * p.velocity[i];
 
-		for (int idx = 0, y = oy - 1, y_end = y + 3; y <= y_end; y++)
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			for (int z = oz - 1, z_end = z + 3; z <= z_end; z++)
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
 			{
-				for (int x = ox - 1, x_end = x + 3; x <= x_end; x++, idx++)
+				GridNode &node = nodeAt(x, y, z);
+				Real w = nodeWeight(weights, l, j, k);
+				node.mass += w * mass;
+				if (w > BSPLINE_EPSILON)
 				{
-					double w = p.weights[idx];
-					if (w > BSPLINE_EPSILON)
-					{
-						// APIC: transfer from particles to grid is motivated analogously to the piecewise rigid case
-						int n = (int)(y*size[0]*size[2] + z*size[0] + x);
-						nodes[n].velocity += w * p.mass * (p.velocity + p.affine_state * p.inertia_tensor_reverse * (nodes_position[n] - p.position));
-						nodes[n].active = true;
-					}
+					node.velocity += (w * (momentum + affine * (nodePosition(x, y, z) - p.position[i]))).cast<Accum>();
+					node.active = true;
 				}
 			}
 		}
 	}
+}
+
+// APIC: affine momentum m*C, with C = B*D^-1
+// MLS-MPM: the stress term -dt*energy*D^-1 is added, which replaces the weight gradient
+// of the explicit force pass with w*D^-1*(x_i - x_p)
+Matrix3r Grid::affineMomentum(int i, double dt) const
+{
+	const ParticleArrays& p = point_cloud->particles;
+	const Matrix3r& inertia = inertiaInverse(i);
+
+	Matrix3r affine = p.mass[i] * p.affine_state[i] * inertia;
+	if (mls_transfer)
+	{
+		affine -= dt * p.stress[i] * inertia;
+	}
+	return affine;
+}
+
+// Maps velocity to the grid
+void Grid::initializeVelocities(double dt)
+{
+	// Interpolate velocity after mass, to conserve momentum
+	// Particles have not moved since initializeMass, so its bins are still valid
+	dispatchKernel(kernel, [this, dt](auto k) {
+		typedef decltype(k) K;
+		scatterColored([this, dt](int i) { scatterVelocity<K>(i, dt); });
+	});
+
+	normalizeVelocities(dt);
+}
+
+// Turn scattered momentum into velocity
+void Grid::normalizeVelocities(double dt)
+{
+	// From here on, grid passes only visit the nodes that received momentum
+	buildActiveNodes();
+
+	forEachActiveNode([](GridNode& node, int, int, int) {
+		node.velocity /= node.mass;
+	});
+
+	collisionGrid(dt);
+}
+
+// Interpolate particle momentum onto its stencil
+template <class K>
+void Grid::scatterVelocity(int i, double dt)
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
+
+	Matrix3r affine = affineMomentum(i, dt);
+	Vector3r momentum = p.mass[i] * p.velocity[i];
 
-	for (int i = 0; i < nodes_length; i++)
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
 	{
-		GridNode &node = nodes[i];
-		if (node.active)
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			node.velocity /= node.mass;
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
+			{
+				Real w = nodeWeight(weights, l, j, k);
+				if (w > BSPLINE_EPSILON)
+				{
+					// APIC: transfer from particles to grid is motivated analogously to the piecewise rigid case
+					GridNode &node = nodeAt(x, y, z);
+					node.velocity += (w * (momentum + affine * (nodePosition(x, y, z) - p.position[i]))).cast<Accum>();
+					node.active = true;
+				}
+			}
 		}
 	}
-
-	collisionGrid();
 }
 
 // Maps volume from the grid to particles
@@ -173,115 +300,272 @@ void Grid::initializeVelocities()
 void Grid::calculateVolumes() const
 {
 	// Estimate each particles volume (for force calculations)
-	for (int i = 0; i < point_cloud->size; i++)
-	{
-		Particle& p = point_cloud->particles[i];
+	dispatchKernel(kernel, [this](auto k) {
+		typedef decltype(k) K;
+		forEachParticle([this](int i) { computeVolume<K>(i); });
+	});
+}
 
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1],
-			oz = p.grid_position[2];
+template <class K>
+void Grid::computeVolume(int i) const
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
 
-		// First compute particle density
-		p.density = 0;
-		for (int idx = 0, y = oy - 1, y_end = y + 3; y <= y_end; y++)
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	// First compute particle density
+	p.density[i] = 0;
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			for (int z = oz - 1, z_end = z + 3; z <= z_end; z++)
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
 			{
-				for (int x = ox - 1, x_end = x + 3; x <= x_end; x++, idx++)
+				Real w = nodeWeight(weights, l, j, k);
+				if (w > BSPLINE_EPSILON)
 				{
-					double w = p.weights[idx];
-					if (w > BSPLINE_EPSILON)
-					{
-						// Node density is trivial
-						p.density += w * nodes[(int)(y*size[0]*size[2] + z*size[0] + x)].mass;
-					}
+					// Node density is trivial
+					p.density[i] += w * nodeAt(x, y, z).mass;
 				}
 			}
 		}
+	}
 
-		p.density /= node_volume;
+	p.density[i] /= node_volume;
 
-		// Volume for each particle can be found from density
-		p.volume = p.mass / p.density;
+	// Volume for each particle can be found from density
+	p.volume[i] = p.mass[i] / p.density[i];
 
-		// First time step initialize the affine state matrix
-		p.affine_state.setZero();
-	}
+	// First time step initialize the affine state matrix
+	p.affine_state[i].setZero();
 }
 
 // Calculate next timestep velocities for use in implicit integration
-void Grid::explicitVelocities(const Eigen::Vector3d& gravity)
+void Grid::explicitVelocities(const Vector3a& gravity, double dt)
 {
+	// MLS-MPM: internal forces were transferred with the momentum
+	if (mls_transfer)
+	{
+		forEachActiveNode([&gravity, dt](GridNode& node, int, int, int) {
+			node.velocity_new = node.velocity + dt * gravity;
+		});
+
+		collisionGrid(dt);
+		return;
+	}
+
 	// First, compute the forces
 	// We store force in velocity_new, since we're not using that variable at the moment
-	for (int i = 0; i < point_cloud->size; i++)
-	{
-		Particle& p = point_cloud->particles[i];
+	dispatchKernel(kernel, [this](auto k) {
+		typedef decltype(k) K;
+		for (int i = 0; i < point_cloud->size; i++)
+		{
+			scatterForce<K>(i);
+		}
+	});
 
-		// Solve for grid internal forces
-		Eigen::Matrix3d energy = p.energyDerivative();
+	// Compute velocities (euler integration)
+	forEachActiveNode([&gravity, dt](GridNode& node, int, int, int) {
+		node.velocity_new = node.velocity + dt * (gravity - node.velocity_new / node.mass);
+	});
+
+	collisionGrid(dt);
+}
+
+template <class K>
+void Grid::scatterForce(int i)
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
+	const SplineWeights& slopes = p.spline_slopes[i];
 
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1],
-			oz = p.grid_position[2];
+	// Grid internal forces, from the stress cached by the last plasticity update
+	const Matrix3r& energy = p.stress[i];
 
-		for (int idx = 0, y = oy - 1, y_end = y + 3; y <= y_end; y++)
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			for (int z = oz - 1, z_end = z + 3; z <= z_end; z++)
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
 			{
-				for (int x = ox - 1, x_end = x + 3; x <= x_end; x++, idx++)
+				Real w = nodeWeight(weights, l, j, k);
+				if (w > BSPLINE_EPSILON)
 				{
-					double w = p.weights[idx];
-					if (w > BSPLINE_EPSILON)
-					{
-						// Weight the force onto nodes
-						int n = (int)(y*size[0]*size[2] + z*size[0] + x);
-						nodes[n].velocity_new += energy * p.weight_gradient[idx];
-					}
+					// Weight the force onto nodes
+					nodeAt(x, y, z).velocity_new += (energy * nodeGradient(weights, slopes, l, j, k)).cast<Accum>();
 				}
 			}
 		}
 	}
+}
 
-	// Compute velocities (euler integration)
-	for (int i = 0; i < nodes_length; i++)
+void Grid::implicitVelocities(double dt)
+{
+	// Conjugate residuals, with inner products weighted by node mass so that A is self-adjoint
+	// Start from the explicit velocities: r = v* - A v*
+	forEachActiveNode([](GridNode& node, int, int, int) {
+		node.r = node.velocity_new;
+	});
+	applyImplicit(dt);
+
+	double target = sumActiveNodes([](GridNode& node) {
+		node.r = node.velocity_new - node.Ar;
+		return node.mass * lengthSquared(node.velocity_new);
+	});
+	target *= implicit_tolerance * implicit_tolerance;
+
+	applyImplicit(dt);
+
+	double rAr = sumActiveNodes([](GridNode& node) {
+		node.p = node.r;
+		node.Ap = node.Ar;
+		return node.mass * node.r.dot(node.Ar);
+	});
+	double ApAp = sumActiveNodes([](GridNode& node) {
+		return node.mass * lengthSquared(node.Ap);
+	});
+
+	for (implicit_iterations = 0; implicit_iterations < max_implicit_iterations; implicit_iterations++)
+	{
+		if (ApAp <= 0)
+		{
+			break;
+		}
+
+		// Step along p, and check the new residual
+		double alpha = rAr / ApAp;
+		double rr = sumActiveNodes([alpha](GridNode& node) {
+			node.velocity_new += alpha * node.p;
+			node.r -= alpha * node.Ap;
+			return node.mass * lengthSquared(node.r);
+		});
+		if (rr <= target)
+		{
+			implicit_iterations++;
+			break;
+		}
+
+		// Next search direction; A p follows from A r without another product
+		applyImplicit(dt);
+		double next = sumActiveNodes([](GridNode& node) {
+			return node.mass * node.r.dot(node.Ar);
+		});
+		double beta = next / rAr;
+		rAr = next;
+		ApAp = sumActiveNodes([beta](GridNode& node) {
+			node.p = node.r + beta * node.p;
+			node.Ap = node.Ar + beta * node.Ap;
+			return node.mass * lengthSquared(node.Ap);
+		});
+	}
+
+	collisionGrid(dt);
+}
+
+// Ar = r + ratio * dt * M^-1 * sum_p dE_p(dt * grad(r) * Fe) * grad(w)
+// (the force differential is minus the scattered term)
+void Grid::applyImplicit(double dt)
+{
+	forEachActiveNode([](GridNode& node, int, int, int) {
+		node.Ar.setZero();
+	});
+
+	// Each particle only reads r and writes Ar, so gather and scatter share the coloured pass
+	dispatchKernel(kernel, [this, dt](auto k) {
+		typedef decltype(k) K;
+		scatterColored([this, dt](int i) { applyImplicitParticle<K>(i, dt); });
+	});
+
+	double scale = implicit_ratio * dt;
+	forEachActiveNode([scale](GridNode& node, int, int, int) {
+		node.Ar = node.r + scale / node.mass * node.Ar;
+	});
+}
+
+template <class K>
+void Grid::applyImplicitParticle(int i, double dt)
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
+	const SplineWeights& slopes = p.spline_slopes[i];
+
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	// Velocity gradient of r at the particle
+	Matrix3r grad = Matrix3r::Zero();
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
 	{
-		GridNode &node = nodes[i];
-		if (node.active)
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			node.velocity_new = node.velocity + TIMESTEP * (gravity - node.velocity_new / node.mass);
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
+			{
+				if (nodeWeight(weights, l, j, k) > BSPLINE_EPSILON)
+				{
+					grad += outerProduct(nodeAt(x, y, z).r.cast<Real>(), nodeGradient(weights, slopes, l, j, k));
+				}
+			}
 		}
 	}
 
-	collisionGrid();
+	// Deformation after a step at those velocities, and the stress it adds
+	Matrix3r delta = p.deltaEnergyDerivative(i, dt * grad * p.def_elastic[i]);
+
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
+		{
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
+			{
+				if (nodeWeight(weights, l, j, k) > BSPLINE_EPSILON)
+				{
+					nodeAt(x, y, z).Ar += (delta * nodeGradient(weights, slopes, l, j, k)).cast<Accum>();
+				}
+			}
+		}
+	}
 }
 
 // APIC: Update the B(n, p) affine state matrix in patticles
 void Grid::updateAffineState() const
 {
-	for (int i = 0; i < point_cloud->size; i++)
-	{
-		Particle& p = point_cloud->particles[i];
+	dispatchKernel(kernel, [this](auto k) {
+		typedef decltype(k) K;
+		forEachParticle([this](int i) { gatherAffineState<K>(i); });
+	});
+}
 
-		p.affine_state.setZero();
+template <class K>
+void Grid::gatherAffineState(int i) const
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
 
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1],
-			oz = p.grid_position[2];
+	p.affine_state[i].setZero();
 
-		for (int idx = 0, y = oy - 1, y_end = y + 3; y <= y_end; y++)
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			for (int z = oz - 1, z_end = z + 3; z <= z_end; z++)
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
 			{
-				for (int x = ox - 1, x_end = x + 3; x <= x_end; x++, idx++)
+				Real w = nodeWeight(weights, l, j, k);
+				if (w > BSPLINE_EPSILON)
 				{
-					double w = p.weights[idx];
-					if (w > BSPLINE_EPSILON)
-					{
-						int n = (y*size[0] * size[2] + z * size[0] + x);
-						// This is calculated for the next time step
-						p.affine_state += w * nodes[n].velocity_new * (nodes_position[n] - p.position).transpose();
-					}
+					// This is calculated for the next time step
+					p.affine_state[i] += w * nodeAt(x, y, z).velocity_new.cast<Real>() * (nodePosition(x, y, z) - p.position[i]).transpose();
 				}
 			}
 		}
@@ -289,120 +573,444 @@ void Grid::updateAffineState() const
 }
 
 // Map grid velocities back to particles
-void Grid::updateVelocities() const
+void Grid::updateVelocities(double dt) const
 {
-	for (int i = 0; i < point_cloud->size; i++)
-	{
-		Particle& p = point_cloud->particles[i];
-		// Reset velocity
-		p.velocity.setZero();
-		// Also keep track of velocity gradient
-		Eigen::Matrix3d& grad = p.velocity_gradient;
-		setData(grad, 0.0);
-		// VISUALIZATION PURPOSES ONLY:
-		// Recompute density
-		p.density = 0;
+	dispatchKernel(kernel, [this](auto k) {
+		typedef decltype(k) K;
+		forEachParticle([this](int i) { gatherVelocity<K>(i); });
+	});
 
-		int ox = p.grid_position[0],
-			oy = p.grid_position[1],
-			oz = p.grid_position[2];
+	collisionParticles(dt);
+}
 
-		for (int idx = 0, y = oy - 1, y_end = y + 3; y <= y_end; y++)
+template <class K>
+void Grid::gatherVelocity(int i) const
+{
+	ParticleArrays& p = point_cloud->particles;
+	const SplineWeights& weights = p.spline_weights[i];
+	const SplineWeights& slopes = p.spline_slopes[i];
+
+	// Reset velocity
+	p.velocity[i].setZero();
+	// Also keep track of velocity gradient
+	Matrix3r& grad = p.velocity_gradient[i];
+	setData(grad, 0);
+	// VISUALIZATION PURPOSES ONLY:
+	// Recompute density
+	p.density[i] = 0;
+
+	int ox = K::base(p.grid_position[i][0]),
+		oy = K::base(p.grid_position[i][1]),
+		oz = K::base(p.grid_position[i][2]);
+
+	for (int j = 0, y = oy; j < K::WIDTH; j++, y++)
+	{
+		for (int k = 0, z = oz; k < K::WIDTH; k++, z++)
 		{
-			for (int z = oz - 1, z_end = z + 3; z <= z_end; z++)
+			for (int l = 0, x = ox; l < K::WIDTH; l++, x++)
 			{
-				for (int x = ox - 1, x_end = x + 3; x <= x_end; x++, idx++)
+				Real w = nodeWeight(weights, l, j, k);
+				if (w > BSPLINE_EPSILON)
 				{
-					double w = p.weights[idx];
-					if (w > BSPLINE_EPSILON)
+					const GridNode &node = nodeAt(x, y, z);
+					Vector3r velocity = node.velocity_new.cast<Real>();
+					// Affine Particle-In-Cell
+					p.velocity[i] += w * velocity;
+					// Velocity gradient
+					if (!mls_transfer)
 					{
-						GridNode &node = nodes[(int)(y*size[0]*size[2] + z*size[0] + x)];
-						// Affine Particle-In-Cell
-						p.velocity += w * node.velocity_new;
-						// Velocity gradient
-						grad += outerProduct(node.velocity_new, p.weight_gradient[idx]);
-						// VISUALIZATION ONLY: Update density
-						p.density += w * node.mass;
+						grad += outerProduct(velocity, nodeGradient(weights, slopes, l, j, k));
 					}
+					// VISUALIZATION ONLY: Update density
+					p.density[i] += w * node.mass;
 				}
 			}
 		}
+	}
 
-		// VISUALIZATION: Update density
-		p.density /= node_volume;
+	// MLS-MPM: the velocity gradient is the affine velocity C = B*D^-1
+	// updateAffineState has already gathered B for this step
+	if (mls_transfer)
+	{
+		grad = p.affine_state[i] * inertiaInverse(i);
 	}
 
-	collisionParticles();
+	// VISUALIZATION: Update density
+	p.density[i] /= node_volume;
 }
 
 // Collision detection on grid
-void Grid::collisionGrid()
+void Grid::collisionGrid(double dt)
+{
+	Vector3a delta_scale = division(Vector3r(dt, dt, dt), cellsize).cast<Accum>();
+
+	forEachActiveNode([this, &delta_scale](GridNode& node, int x, int y, int z) {
+		// Collision response
+		// TODO: make this work for arbitrary collision geometry
+		Vector3a new_pos = dot(node.velocity_new, delta_scale) + Vector3a(x, y, z);
+		// Left border, right border
+		if (new_pos[0] < BSPLINE_RADIUS || new_pos[0] > size[0] - BSPLINE_RADIUS - 1)
+		{
+			node.velocity_new[0] = 0;
+			node.velocity_new[1] *= sticky;
+			node.velocity_new[2] *= sticky;
+		}
+		// Bottom border, top border
+		if (new_pos[1] < BSPLINE_RADIUS || new_pos[1] > size[1] - BSPLINE_RADIUS - 1)
+		{
+			node.velocity_new[0] *= sticky;
+			node.velocity_new[1] = 0;
+			node.velocity_new[2] *= sticky;
+		}
+		// Front border, back border
+		if (new_pos[2] < BSPLINE_RADIUS || new_pos[2] > size[2] - BSPLINE_RADIUS - 1)
+		{
+			node.velocity_new[0] *= sticky;
+			node.velocity_new[1] *= sticky;
+			node.velocity_new[2] = 0;
+		}
+	});
+}
+
+// Collision detection on particle
+void Grid::collisionParticles(double dt) const
+{
+	forEachParticle([this, dt](int i) {
+		ParticleArrays& p = point_cloud->particles;
+		Vector3r new_pos = p.grid_position[i] + dt * division(p.velocity[i], cellsize);
+		// Left border, right border
+		if (new_pos[0] < BSPLINE_RADIUS - 1 || new_pos[0] > size[0] - BSPLINE_RADIUS)
+		{
+			p.velocity[i][0] = -sticky * p.velocity[i][0];
+		}
+		// Bottom border, top border
+		if (new_pos[1] < BSPLINE_RADIUS - 1 || new_pos[1] > size[1] - BSPLINE_RADIUS)
+		{
+			p.velocity[i][1] = -sticky * p.velocity[i][1];
+		}
+		// Front border, back border
+		if (new_pos[2] < BSPLINE_RADIUS - 1 || new_pos[2] > size[2] - BSPLINE_RADIUS)
+		{
+			p.velocity[i][2] = -sticky * p.velocity[i][2];
+		}
+	});
+}
+
+
+bool Grid::parallelScatter() const
+{
+	return thread_pool != NULL && thread_pool->size() > 1;
+}
+
+// Sort particles into blocks (stable counting sort) and list the occupied blocks of each colour
+// Only occupied blocks are visited, so the cost does not depend on the domain size
+void Grid::binParticles()
 {
-	Eigen::Vector3d delta_scale = Eigen::Vector3d(TIMESTEP, TIMESTEP, TIMESTEP);
-	delta_scale = division(delta_scale, cellsize);
+	ParticleArrays& particles = point_cloud->particles;
 
-	for (int y = 0, idx = 0; y < size[1]; y++)
+	particle_block.resize(point_cloud->size);
+	scatter_order.resize(point_cloud->size);
+	occupied_blocks.clear();
+
+	for (int i = 0; i < point_cloud->size; i++)
+	{
+		// Same cell as computeWeights finds; binning runs before the weights in the fused transfer
+		Vector3r cell = division(particles.position[i] - origin, cellsize);
+		int b[3];
+		bool stray = false;
+		for (int d = 0; d < 3; d++)
+		{
+			// Stencils reach one node below the cell and two above, so particles must stay in the band
+			// collisionParticles keeps them in; a blown-up step can still throw them out, or make them NaN.
+			// Those are put back just inside it rather than indexing past the blocks
+			Real low = BSPLINE_RADIUS - 1 + (Real)0.01,
+				 high = size[d] - BSPLINE_RADIUS - (Real)0.01;
+			if (!(cell[d] >= low))
+			{
+				cell[d] = low;
+				stray = true;
+			}
+			else if (!(cell[d] <= high))
+			{
+				cell[d] = high;
+				stray = true;
+			}
+			b[d] = (int)cell[d] / GRID_BLOCK;
+		}
+		if (stray)
+		{
+			particles.position[i] = origin + cell.cwiseProduct(cellsize);
+			particles.velocity[i].setZero();
+			stray_particles++;
+		}
+		int block = (b[1] * blocks_size[2] + b[2]) * blocks_size[0] + b[0];
+		particle_block[i] = block;
+		if (block_particles[block]++ == 0)
+		{
+			occupied_blocks.push_back(block);
+		}
+	}
+
+	// Block order keeps the scatter deterministic
+	std::sort(occupied_blocks.begin(), occupied_blocks.end());
+
+	for (int c = 0; c < SCATTER_COLORS; c++)
+	{
+		color_blocks[c].clear();
+	}
+
+	int occupied = (int)occupied_blocks.size();
+	bin_start.resize(occupied + 1);
+	bin_fill.resize(occupied);
+	bin_start[0] = 0;
+	for (int o = 0; o < occupied; o++)
 	{
-		for (int z = 0; z < size[2]; z++)
+		int b = occupied_blocks[o];
+		bin_start[o + 1] = bin_start[o] + block_particles[b];
+		bin_fill[o] = bin_start[o];
+
+		int bx = b % blocks_size[0],
+			bz = (b / blocks_size[0]) % blocks_size[2],
+			by = b / (blocks_size[0] * blocks_size[2]);
+		color_blocks[(bx & 1) | (by & 1) << 1 | (bz & 1) << 2].push_back(o);
+
+		// Reuse the counter to find the bin while filling it
+		block_particles[b] = o;
+	}
+
+	for (int i = 0; i < point_cloud->size; i++)
+	{
+		scatter_order[bin_fill[block_particles[particle_block[i]]]++] = i;
+	}
+
+	for (int o = 0; o < occupied; o++)
+	{
+		block_particles[occupied_blocks[o]] = 0;
+	}
+}
+
+// Allocate and clear the node blocks reached by this step's particles
+// Particles in a block touch nodes from one below to two above it, so each occupied block
+// needs itself and its neighbours
+void Grid::allocateBlocks()
+{
+	// Release last step's blocks
+	for (int s = 0; s < block_count; s++)
+	{
+		block_table[blocks[s].id] = -1;
+	}
+	block_count = 0;
+
+	std::vector<int> allocated;
+	for (size_t o = 0; o < occupied_blocks.size(); o++)
+	{
+		int b = occupied_blocks[o],
+			bx = b % blocks_size[0],
+			bz = (b / blocks_size[0]) % blocks_size[2],
+			by = b / (blocks_size[0] * blocks_size[2]);
+
+		for (int y = by - 1; y <= by + 1; y++)
 		{
-			for (int x = 0; x < size[0]; x++, idx++)
+			for (int z = bz - 1; z <= bz + 1; z++)
 			{
-				// Get grid node (equivalent to (y*size[0]*size[2] + z*size[0] + x))
-				GridNode &node = nodes[idx];
-				// Check to see if this node needs to be computed
-				if (node.active)
+				for (int x = bx - 1; x <= bx + 1; x++)
 				{
-					// Collision response
-					// TODO: make this work for arbitrary collision geometry
-					Eigen::Vector3d new_pos = dot(node.velocity_new, delta_scale) + Eigen::Vector3d(x, y, z);
-					// Left border, right border
-					if (new_pos[0] < BSPLINE_RADIUS || new_pos[0] > size[0] - BSPLINE_RADIUS - 1)
-					{
-						node.velocity_new[0] = 0;
-						node.velocity_new[1] *= STICKY;
-						node.velocity_new[2] *= STICKY;
-					}
-					// Bottom border, top border
-					if (new_pos[1] < BSPLINE_RADIUS || new_pos[1] > size[1] - BSPLINE_RADIUS - 1)
+					if (x < 0 || y < 0 || z < 0 || x >= blocks_size[0] || y >= blocks_size[1] || z >= blocks_size[2])
 					{
-						node.velocity_new[0] *= STICKY;
-						node.velocity_new[1] = 0;
-						node.velocity_new[2] *= STICKY;
+						continue;
 					}
-					// Front border, back border
-					if (new_pos[2] < BSPLINE_RADIUS || new_pos[2] > size[2] - BSPLINE_RADIUS - 1)
+					int n = (y * blocks_size[2] + z) * blocks_size[0] + x;
+					if (block_table[n] < 0)
 					{
-						node.velocity_new[0] *= STICKY;
-						node.velocity_new[1] *= STICKY;
-						node.velocity_new[2] = 0;
+						block_table[n] = block_count++;
+						allocated.push_back(n);
 					}
 				}
 			}
 		}
 	}
+
+	if ((int)blocks.size() < block_count)
+	{
+		blocks.resize(block_count);
+	}
+
+	forEachBlock([this, &allocated](GridBlock& block) {
+		int n = allocated[&block - &blocks[0]];
+		block.id = n;
+		block.x = (n % blocks_size[0]) * GRID_BLOCK;
+		block.z = ((n / blocks_size[0]) % blocks_size[2]) * GRID_BLOCK;
+		block.y = (n / (blocks_size[0] * blocks_size[2])) * GRID_BLOCK;
+		for (int i = 0; i < BLOCK_NODES; i++)
+		{
+			block.nodes[i].clear();
+		}
+	});
 }
 
-// Collision detection on particle
-void Grid::collisionParticles() const
+// Run a scatter over all particles, one colour at a time
+// Blocks of the same colour write to disjoint nodes, and each block keeps particle order;
+// a single worker walks the bins in the same order, so the result does not depend on the number of workers
+void Grid::scatterColored(const std::function<void(int)>& scatter)
 {
-	for (int i = 0; i < point_cloud->size; i++)
+	for (int c = 0; c < SCATTER_COLORS; c++)
 	{
-		Particle& p = point_cloud->particles[i];
-		Eigen::Vector3d new_pos = p.grid_position + TIMESTEP * division(p.velocity, cellsize);
-		// Left border, right border
-		if (new_pos[0] < BSPLINE_RADIUS - 1 || new_pos[0] > size[0] - BSPLINE_RADIUS)
+		const std::vector<int>& bins = color_blocks[c];
+		auto visit = [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+			{
+				int o = bins[i];
+				for (int k = bin_start[o]; k < bin_start[o + 1]; k++)
+				{
+					scatter(scatter_order[k]);
+				}
+			}
+		};
+
+		if (parallelScatter())
 		{
-			p.velocity[0] = -STICKY * p.velocity[0];
+			thread_pool->parallelFor((int)bins.size(), visit, 1);
 		}
-		// Bottom border, top border
-		if (new_pos[1] < BSPLINE_RADIUS - 1 || new_pos[1] > size[1] - BSPLINE_RADIUS)
+		else
 		{
-			p.velocity[1] = -STICKY * p.velocity[1];
+			visit(0, (int)bins.size());
 		}
-		// Front border, back border
-		if (new_pos[2] < BSPLINE_RADIUS - 1 || new_pos[2] > size[2] - BSPLINE_RADIUS)
+	}
+}
+
+// Run func on every particle, in parallel when workers are available
+// Only for passes that read the grid and write to their own particle
+void Grid::forEachParticle(const std::function<void(int)>& func) const
+{
+	if (thread_pool == NULL)
+	{
+		for (int i = 0; i < point_cloud->size; i++)
+		{
+			func(i);
+		}
+		return;
+	}
+
+	thread_pool->parallelFor(point_cloud->size, [&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+		{
+			func(i);
+		}
+	});
+}
+
+// Run func on every allocated block, in parallel when workers are available
+void Grid::forEachBlock(const std::function<void(GridBlock&)>& func)
+{
+	if (thread_pool == NULL)
+	{
+		for (int s = 0; s < block_count; s++)
+		{
+			func(blocks[s]);
+		}
+		return;
+	}
+
+	thread_pool->parallelFor(block_count, [&](int begin, int end) {
+		for (int s = begin; s < end; s++)
+		{
+			func(blocks[s]);
+		}
+	});
+}
+
+// Collect the active nodes of all allocated blocks, in block order
+void Grid::buildActiveNodes()
+{
+	// Count per block, then fill each block's range of the list
+	active_start.resize(block_count + 1);
+	active_start[0] = 0;
+	forEachBlock([this](GridBlock& block) {
+		int count = 0;
+		for (int i = 0; i < BLOCK_NODES; i++)
+		{
+			if (block.nodes[i].active) count++;
+		}
+		active_start[&block - &blocks[0] + 1] = count;
+	});
+
+	for (int s = 0; s < block_count; s++)
+	{
+		active_start[s + 1] += active_start[s];
+	}
+	active_nodes.resize(active_start[block_count]);
+
+	forEachBlock([this](GridBlock& block) {
+		int slot = (int)(&block - &blocks[0]),
+			fill = active_start[slot];
+		for (int i = 0; i < BLOCK_NODES; i++)
+		{
+			if (block.nodes[i].active)
+			{
+				active_nodes[fill++] = slot * BLOCK_NODES + i;
+			}
+		}
+	});
+}
+
+// Run func on every active node with its grid coordinates, in parallel when workers are available
+void Grid::forEachActiveNode(const std::function<void(GridNode&, int, int, int)>& func)
+{
+	auto visit = [&](int begin, int end) {
+		for (int a = begin; a < end; a++)
 		{
-			p.velocity[2] = -STICKY * p.velocity[2];
+			GridBlock& block = blocks[active_nodes[a] / BLOCK_NODES];
+			int i = active_nodes[a] % BLOCK_NODES;
+			func(block.nodes[i],
+				block.x + i % GRID_BLOCK,
+				block.y + i / (GRID_BLOCK * GRID_BLOCK),
+				block.z + (i / GRID_BLOCK) % GRID_BLOCK);
 		}
+	};
+
+	if (thread_pool == NULL)
+	{
+		visit(0, (int)active_nodes.size());
+		return;
+	}
+
+	thread_pool->parallelFor((int)active_nodes.size(), visit);
+}
+
+// Sum func over the active nodes, in parallel when workers are available
+// Partial sums are kept per chunk and added in order, so the result does not depend on the number of workers
+double Grid::sumActiveNodes(const std::function<double(GridNode&)>& func)
+{
+	const int grain = 1024;
+	int count = (int)active_nodes.size();
+	std::vector<double> partial((count + grain - 1) / grain, 0.0);
+
+	auto visit = [&](int begin, int end) {
+		for (int c = begin; c < end; c++)
+		{
+			double sum = 0;
+			int last = (c + 1) * grain < count ? (c + 1) * grain : count;
+			for (int a = c * grain; a < last; a++)
+			{
+				sum += func(blocks[active_nodes[a] / BLOCK_NODES].nodes[active_nodes[a] % BLOCK_NODES]);
+			}
+			partial[c] = sum;
+		}
+	};
+
+	if (thread_pool == NULL)
+	{
+		visit(0, (int)partial.size());
+	}
+	else
+	{
+		thread_pool->parallelFor((int)partial.size(), visit);
+	}
+
+	double sum = 0;
+	for (size_t c = 0; c < partial.size(); c++)
+	{
+		sum += partial[c];
 	}
+	return sum;
 }
\ No newline at end of file
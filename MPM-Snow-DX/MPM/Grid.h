@@ -6,103 +6,236 @@
 #include <cstring>
 #include <stdio.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
 
 #include "SimulationParameters.h"
 #include "PointCloud.h"
+#include "ThreadPool.h"
+#include "Kernel.h"
+#include "SimulationConfig.h"
 
-const double BSPLINE_EPSILON = 1e-4;
 const int   BSPLINE_RADIUS = 2;
 
+// Sparse grid: nodes are stored in blocks of GRID_BLOCK^3, allocated only around particles
+const int GRID_BLOCK = 4;
+const int BLOCK_NODES = GRID_BLOCK * GRID_BLOCK * GRID_BLOCK;
+
+// Parallel scatter: particles are binned by the block their cell falls in.
+// A particle stencil reaches one node below and two above its cell, so blocks
+// that are two apart on every axis never write to the same node.
+// Blocks are coloured by the parity of their coordinates and each colour runs in parallel.
+const int SCATTER_COLORS = 8;
+
 // Grid node data
+// Nodes sum contributions from many particles, so they are kept at accumulation precision
 struct GridNode
 {
-	double mass;
+	Accum mass;
 	bool active;
-	Eigen::Vector3d velocity, velocity_new;
+	Vector3a velocity, velocity_new;
+
+	// Implicit solve: conjugate residual vectors r and p, and their products with the system matrix
+	Vector3a r, p, Ar, Ap;
+
+	// Zero and inactive
+	// Field by field: value-initialising a GridNode does not reliably zero the Eigen members
+	void clear()
+	{
+		mass = 0;
+		active = false;
+		velocity.setZero();
+		velocity_new.setZero();
+		r.setZero();
+		p.setZero();
+		Ar.setZero();
+		Ap.setZero();
+	}
+};
+
+// A GRID_BLOCK^3 brick of nodes
+struct GridBlock
+{
+	// Block index in the block table and grid coordinates of its first node
+	int id;
+	int x, y, z;
+	// Nodes: use (y*GRID_BLOCK*GRID_BLOCK + z*GRID_BLOCK + x) to index, like the full grid
+	GridNode nodes[BLOCK_NODES];
 };
 
 class Grid
 {
 public:
-	Eigen::Vector3d origin, size, cellsize;
+	Vector3r origin, size, cellsize;
 	PointCloud* point_cloud;
-	double node_volume;
-	// Nodes: use (y*size[0]*size[2] + z*size[0] + x) to index, where zero is the bottom-left corner (e.g. like a cartesian grid)
-	int nodes_length;
-	GridNode* nodes;
-
-	// APIC: grid node position
-	// Stored outside GridNode to prevent this data being cleared
-	Eigen::Vector3d* nodes_position;
-
+	Real node_volume;
+	// Blocks: use (by*blocks_size[0]*blocks_size[2] + bz*blocks_size[0] + bx) to index the block table,
+	// where zero is the bottom-left corner (e.g. like a cartesian grid)
+	// Only the first block_count entries of blocks are in use this step
+	int blocks_size[3];
+	int block_count;
+	std::vector<GridBlock> blocks;
+	// Particles that had left the grid (or become NaN) and were put back at its edge, over the whole run
+	long long stray_particles;
+
+	// Nodes that received momentum this step, as (block slot * BLOCK_NODES + node index)
+	// Built by initializeVelocities; the grid update and collision passes only visit these
+	std::vector<int> active_nodes;
+
+	// Workers for parallel transfers; NULL (or a single worker) runs everything serially
+	ThreadPool* thread_pool;
+
+	// Interpolation kernel of the transfers
+	KernelType kernel;
+
+	// APIC: for B-splines on a uniform grid the inertia tensor is the same for every particle,
+	// D = (1/3)h^2 I for cubic and (1/4)h^2 I for quadratic
+	// When set, its inverse is used directly and the per-particle D accumulation is skipped
+	bool closed_form_inertia;
+	Matrix3r inertia_inverse;
+
+	// MLS-MPM: stress is folded into the affine momentum during particle-to-grid
+	// and the velocity gradient is taken from C, so no weight gradients are needed
+	bool mls_transfer;
+
+	// Semi-implicit velocity update (Stomakhin et al. 2013), solved after explicitVelocities
+	// implicit_ratio blends explicit (0) and fully implicit (1) forces
+	// The solve stops after max_implicit_iterations, or once the residual falls below implicit_tolerance
+	bool implicit_solve;
+	double implicit_ratio, implicit_tolerance;
+	int max_implicit_iterations;
+	// Conjugate residual iterations taken by the last solve
+	int implicit_iterations;
+
+	// Collision stickiness (lower = stickier)
+	double sticky;
+
+	// Box, resolution and transfer settings from config
 	// Grid should be at least one cell; there must be one layer of cells surrounding all particles
-	Grid(Eigen::Vector3d pos, Eigen::Vector3d dims, Eigen::Vector3d cells, PointCloud* obj);
+	Grid(const SimulationConfig& config, PointCloud* obj);
 	Grid(const Grid& orig);
 	virtual ~Grid();
 
 	// Map particles to grid
 	void initializeMass();
-	void initializeVelocities();
+	void initializeVelocities(double dt);
 
 	// APIC: initialize inertia-like tensor matrix
 	void initializeInertiaTensor();
 
+	// Fused transfer: initializeMass, initializeInertiaTensor and initializeVelocities in one particle sweep
+	void particleToGrid(double dt);
+
 	// Map grid volumes back to particles (first timestep only)
 	void calculateVolumes() const;
 
 	// Compute grid velocities
-	void explicitVelocities(const Eigen::Vector3d& gravity);
+	// With mls_transfer the forces are already in the grid momentum and only gravity is added
+	void explicitVelocities(const Vector3a& gravity, double dt);
+
+	// Solve (I + implicit_ratio * dt^2 * M^-1 * H) v = v* on the active nodes, where v* are the explicit
+	// velocities and H is the elastic energy Hessian, applied matrix-free through the particles
+	void implicitVelocities(double dt);
 
 	// APIC: update affine matrix component of particles
 	void updateAffineState() const;
 
 	// Map grid velocities back to particles
-	void updateVelocities() const;
+	void updateVelocities(double dt) const;
 
 	// Collision detection
-	void collisionGrid();
-	void collisionParticles() const;
+	// dt is the step the velocities will be integrated over
+	void collisionGrid(double dt);
+	void collisionParticles(double dt) const;
 
-	// One-dimensional cubic B-splines
-	// A smooth curve from (0,1) to (1,0)
-	static double B_Spline(double x)
+	// Node at grid coordinates; its block must be allocated
+	// binParticles keeps every particle's stencil inside allocated blocks
+	GridNode& nodeAt(int x, int y, int z)
 	{
-		x = fabs(x);
-		double w;
-
-		if (x < 1)
-		{
-			w = x * x * (x / 2 - 1) + 2 / 3.0;
-		}
-		else if (x < 2)
-		{
-			w = x * (x * (-x / 6 + 1) - 2) + 4 / 3.0;
-		}
-		else return 0;
-		
-		if (w < BSPLINE_EPSILON)
-		{
-			return 0;
-		}
-
-		return w;
+		return blocks[block_table[blockIndex(x, y, z)]].nodes[localIndex(x, y, z)];
 	}
-	// Slope of interpolation function (derivative)
-	static double B_SplineSlope(double x)
+	const GridNode& nodeAt(int x, int y, int z) const
 	{
-		double abs_x = fabs(x);
-
-		if (abs_x < 1)
-		{
-			return 1.5 * x * abs_x - 2 * x;
-		}
-		else if (x < 2)
-		{
-			return -x * abs_x / 2 + 2 * x - 2 * x / abs_x;
-		}
-		else return 0;
+		return blocks[block_table[blockIndex(x, y, z)]].nodes[localIndex(x, y, z)];
 	}
 
+	// APIC: grid node position, consistent with the particle grid coordinates
+	Vector3r nodePosition(int x, int y, int z) const
+	{
+		return origin + Vector3r(x * cellsize(0), y * cellsize(1), z * cellsize(2));
+	}
+
+	// Stencil node weight, the dyadic product of weights in each dimension
+	static Real nodeWeight(const SplineWeights& w, int x, int y, int z)
+	{
+		return w(0, x) * w(1, y) * w(2, z);
+	}
+	// Weight gradient is a vector of partial derivatives
+	static Vector3r nodeGradient(const SplineWeights& w, const SplineWeights& slope, int x, int y, int z)
+	{
+		return Vector3r(
+			slope(0, x) * w(1, y) * w(2, z),
+			w(0, x) * slope(1, y) * w(2, z),
+			w(0, x) * w(1, y) * slope(2, z));
+	}
+
+private:
+	// Block table: slot in blocks for every block of the domain, or -1 when it is not allocated
+	std::vector<int> block_table;
+
+	// Particle bins, rebuilt by initializeMass
+	// Occupied blocks are sorted by block index; their particles are in scatter_order[bin_start[o], bin_start[o + 1])
+	std::vector<int> block_particles, particle_block, scatter_order;
+	std::vector<int> occupied_blocks, bin_start, bin_fill;
+	std::vector<int> color_blocks[SCATTER_COLORS];
+
+	// Start of each block's entries in active_nodes
+	std::vector<int> active_start;
+
+	int blockIndex(int x, int y, int z) const
+	{
+		return ((y / GRID_BLOCK) * blocks_size[2] + z / GRID_BLOCK) * blocks_size[0] + x / GRID_BLOCK;
+	}
+	static int localIndex(int x, int y, int z)
+	{
+		return ((y % GRID_BLOCK) * GRID_BLOCK + z % GRID_BLOCK) * GRID_BLOCK + x % GRID_BLOCK;
+	}
+
+	// Per-particle parts of the transfers, templated on the interpolation kernel
+	template <class K> void computeWeights(int i) const;
+	template <class K> void scatterMass(int i);
+	template <class K> void scatterVelocity(int i, double dt);
+	template <class K> void computeInertiaTensor(int i);
+	template <class K> void scatterParticle(int i, double dt);
+	template <class K> void computeVolume(int i) const;
+	template <class K> void scatterForce(int i);
+	template <class K> void gatherAffineState(int i) const;
+	template <class K> void gatherVelocity(int i) const;
+	template <class K> void applyImplicitParticle(int i, double dt);
+	const Matrix3r& inertiaInverse(int i) const
+	{
+		return closed_form_inertia ? inertia_inverse : point_cloud->particles.inertia_tensor_reverse[i];
+	}
+	Matrix3r affineMomentum(int i, double dt) const;
+	void normalizeVelocities(double dt);
+
+	// Per-particle gathers
+	void forEachParticle(const std::function<void(int)>& func) const;
+
+	// Per-block and per-node grid updates
+	void forEachBlock(const std::function<void(GridBlock&)>& func);
+	void buildActiveNodes();
+	void forEachActiveNode(const std::function<void(GridNode&, int, int, int)>& func);
+	double sumActiveNodes(const std::function<double(GridNode&)>& func);
+
+	// Implicit solve: Ar = A r over the active nodes
+	void applyImplicit(double dt);
+
+	bool parallelScatter() const;
+	void binParticles();
+	void allocateBlocks();
+	void scatterColored(const std::function<void(int)>& scatter);
 };
 
 #endif // !GRID_H
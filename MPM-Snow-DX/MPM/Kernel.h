@@ -0,0 +1,163 @@
+#pragma once
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <math.h>
+
+#include "SimulationParameters.h"
+
+const double BSPLINE_EPSILON = 1e-4;
+
+// Interpolation kernels for the particle-grid transfers
+// Each kernel gives the stencil width, the first stencil node for a grid coordinate,
+// the one-dimensional weight and slope at a distance (in cells) from a node,
+// and the scale of the APIC inertia tensor inverse, D^-1 = inertiaScale() / h^2
+// Grid transfer loops are templated on the kernel; the kernel of a run is picked once per pass,
+// outside the particle loops (see dispatchKernel)
+
+// Cubic B-splines: 4x4x4 stencil starting one node below the particle cell
+struct CubicKernel
+{
+	static const int WIDTH = 4;
+
+	static int base(double x)
+	{
+		return (int)x - 1;
+	}
+
+	static double inertiaScale()
+	{
+		return 3.0;
+	}
+
+	// A smooth curve from (0,1) to (1,0)
+	static double weight(double x)
+	{
+		x = fabs(x);
+		double w;
+
+		if (x < 1)
+		{
+			w = x * x * (x / 2 - 1) + 2 / 3.0;
+		}
+		else if (x < 2)
+		{
+			w = x * (x * (-x / 6 + 1) - 2) + 4 / 3.0;
+		}
+		else return 0;
+
+		if (w < BSPLINE_EPSILON)
+		{
+			return 0;
+		}
+
+		return w;
+	}
+
+	// Slope of interpolation function (derivative)
+	static double slope(double x)
+	{
+		double abs_x = fabs(x);
+
+		if (abs_x < 1)
+		{
+			return 1.5 * x * abs_x - 2 * x;
+		}
+		else if (x < 2)
+		{
+			return -x * abs_x / 2 + 2 * x - 2 * x / abs_x;
+		}
+		else return 0;
+	}
+};
+
+// Quadratic B-splines: 3x3x3 stencil starting at the node nearest to the particle, minus one
+// Cheaper but less smooth; good enough for preview runs
+struct QuadraticKernel
+{
+	static const int WIDTH = 3;
+
+	static int base(double x)
+	{
+		return (int)(x - 0.5);
+	}
+
+	static double inertiaScale()
+	{
+		return 4.0;
+	}
+
+	static double weight(double x)
+	{
+		x = fabs(x);
+		double w;
+
+		if (x < 0.5)
+		{
+			w = 0.75 - x * x;
+		}
+		else if (x < 1.5)
+		{
+			w = 0.5 * (1.5 - x) * (1.5 - x);
+		}
+		else return 0;
+
+		if (w < BSPLINE_EPSILON)
+		{
+			return 0;
+		}
+
+		return w;
+	}
+
+	static double slope(double x)
+	{
+		double abs_x = fabs(x);
+
+		if (abs_x < 0.5)
+		{
+			return -2 * x;
+		}
+		else if (abs_x < 1.5)
+		{
+			return x > 0 ? abs_x - 1.5 : 1.5 - abs_x;
+		}
+		else return 0;
+	}
+};
+
+enum KernelType
+{
+	KERNEL_CUBIC,
+	KERNEL_QUADRATIC
+};
+
+// Default kernel of a run; define MPM_QUADRATIC_KERNEL to default to quadratic B-splines
+#ifdef MPM_QUADRATIC_KERNEL
+const KernelType DEFAULT_KERNEL = KERNEL_QUADRATIC;
+#else
+const KernelType DEFAULT_KERNEL = KERNEL_CUBIC;
+#endif
+
+// Call func with an instance of the selected kernel, so a generic lambda sees it as a compile-time type:
+//   dispatchKernel(kernel, [&](auto k) { typedef decltype(k) K; ... });
+template <class F>
+static void dispatchKernel(KernelType kernel, F func)
+{
+	if (kernel == KERNEL_QUADRATIC)
+	{
+		func(QuadraticKernel());
+	}
+	else
+	{
+		func(CubicKernel());
+	}
+}
+
+// Scale of the APIC inertia tensor inverse of the selected kernel
+inline double inertiaScale(KernelType kernel)
+{
+	return kernel == KERNEL_QUADRATIC ? QuadraticKernel::inertiaScale() : CubicKernel::inertiaScale();
+}
+
+#endif // !KERNEL_H
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+#ifndef LANES_H
+#define LANES_H
+
+#include <math.h>
+
+// A group of N values processed side by side, one per particle of a batch
+// Every operation is a plain loop over the lanes with no branches, so compilers vectorise it
+// for whatever instruction set the build targets; N * sizeof(T) is only one register when that
+// set is as wide (see PARTICLE_LANES)
+template <typename T, int N>
+struct Lanes
+{
+	T v[N];
+
+	Lanes() {}
+	Lanes(T x)
+	{
+		for (int l = 0; l < N; l++) v[l] = x;
+	}
+
+	T& operator[](int l) { return v[l]; }
+	const T& operator[](int l) const { return v[l]; }
+
+	// Defined as friends, so scalars convert on either side
+	friend Lanes operator+(const Lanes& a, const Lanes& b)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = a.v[l] + b.v[l];
+		return r;
+	}
+	friend Lanes operator-(const Lanes& a, const Lanes& b)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = a.v[l] - b.v[l];
+		return r;
+	}
+	friend Lanes operator*(const Lanes& a, const Lanes& b)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = a.v[l] * b.v[l];
+		return r;
+	}
+	friend Lanes operator/(const Lanes& a, const Lanes& b)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = a.v[l] / b.v[l];
+		return r;
+	}
+	friend Lanes operator-(const Lanes& a)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = -a.v[l];
+		return r;
+	}
+
+	Lanes& operator+=(const Lanes& b) { return *this = *this + b; }
+	Lanes& operator-=(const Lanes& b) { return *this = *this - b; }
+	Lanes& operator*=(const Lanes& b) { return *this = *this * b; }
+
+	friend Lanes sqrt(const Lanes& a)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = sqrt(a.v[l]);
+		return r;
+	}
+	friend Lanes rsqrt(const Lanes& a)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = 1 / sqrt(a.v[l]);
+		return r;
+	}
+	friend Lanes exp(const Lanes& a)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = exp(a.v[l]);
+		return r;
+	}
+	friend Lanes abs(const Lanes& a)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = fabs(a.v[l]);
+		return r;
+	}
+	friend Lanes max(const Lanes& a, const Lanes& b)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = a.v[l] > b.v[l] ? a.v[l] : b.v[l];
+		return r;
+	}
+	friend Lanes min(const Lanes& a, const Lanes& b)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = a.v[l] < b.v[l] ? a.v[l] : b.v[l];
+		return r;
+	}
+
+	// Per-lane a < b ? x : y
+	friend Lanes selectLess(const Lanes& a, const Lanes& b, const Lanes& x, const Lanes& y)
+	{
+		Lanes r;
+		for (int l = 0; l < N; l++) r.v[l] = a.v[l] < b.v[l] ? x.v[l] : y.v[l];
+		return r;
+	}
+};
+
+#endif // !LANES_H
\ No newline at end of file
@@ -0,0 +1,308 @@
+#include "ParticleArrays.h"
+
+#include <algorithm>
+
+ParticleArrays::ParticleArrays()
+{
+	configure(SimulationConfig());
+}
+
+ParticleArrays::~ParticleArrays() {}
+
+void ParticleArrays::configure(const SimulationConfig& config)
+{
+	materials.resize(config.materials.size());
+	for (size_t m = 0; m < materials.size(); m++)
+	{
+		const SnowMaterial& material = config.materials[m];
+		materials[m].lambda = material.lambda();
+		materials[m].mu = material.mu();
+		materials[m].crit_compress = material.crit_compress;
+		materials[m].crit_stretch = material.crit_stretch;
+		materials[m].hardening = material.hardening;
+	}
+}
+
+void ParticleArrays::groupMaterials()
+{
+	runs.clear();
+	for (int i = 0; i < size(); i++)
+	{
+		if (runs.empty() || runs.back().material != material[i])
+		{
+			MaterialRun run = { i, i, material[i] };
+			runs.push_back(run);
+		}
+		runs.back().end = i + 1;
+	}
+}
+
+void ParticleArrays::reserve(int count)
+{
+	volume.reserve(count);
+	mass.reserve(count);
+	density.reserve(count);
+	position.reserve(count);
+	velocity.reserve(count);
+	velocity_gradient.reserve(count);
+	inertia_tensor_reverse.reserve(count);
+	affine_state.reserve(count);
+	material.reserve(count);
+	def_elastic.reserve(count);
+	def_plastic.reserve(count);
+	plastic_det.reserve(count);
+	stress.reserve(count);
+	svd_w.reserve(count);
+	svd_v.reserve(count);
+	svd_e.reserve(count);
+	grid_position.reserve(count);
+	spline_weights.reserve(count);
+	spline_slopes.reserve(count);
+	id.reserve(count);
+}
+
+void ParticleArrays::resize(int count)
+{
+	volume.resize(count, 0);
+	mass.resize(count, 0);
+	density.resize(count, 0);
+	position.resize(count, Vector3r::Zero());
+	velocity.resize(count, Vector3r::Zero());
+	velocity_gradient.resize(count, Matrix3r::Zero());
+	inertia_tensor_reverse.resize(count, Matrix3r::Zero());
+	affine_state.resize(count, Matrix3r::Zero());
+	material.resize(count, 0);
+	def_elastic.resize(count, Matrix3r::Zero());
+	def_plastic.resize(count, Matrix3r::Zero());
+	plastic_det.resize(count, 0);
+	stress.resize(count, Matrix3r::Zero());
+	svd_w.resize(count, Matrix3r::Zero());
+	svd_v.resize(count, Matrix3r::Zero());
+	svd_e.resize(count, Vector3r::Zero());
+	grid_position.resize(count, Vector3r::Zero());
+	spline_weights.resize(count, SplineWeights::Zero());
+	spline_slopes.resize(count, SplineWeights::Zero());
+	id.resize(count, 0);
+}
+
+void ParticleArrays::push_back(const Particle& p)
+{
+	Matrix3r identity;
+	loadIdentity(identity);
+
+	position.push_back(p.position.cast<Real>());
+	velocity.push_back(p.velocity.cast<Real>());
+	mass.push_back(p.mass);
+	material.push_back(p.material);
+
+	// Computed from the grid before the first step
+	volume.push_back(0);
+	density.push_back(0);
+	velocity_gradient.push_back(Matrix3r::Zero());
+	inertia_tensor_reverse.push_back(Matrix3r::Zero());
+	affine_state.push_back(Matrix3r::Zero());
+
+	// To start out with, assume the deformation gradient is zero
+	// Or in other words, all particle velocities are the same
+	def_elastic.push_back(identity);
+	def_plastic.push_back(identity);
+	plastic_det.push_back(1);
+	stress.push_back(Matrix3r::Zero());
+	svd_e.push_back(Vector3r(1, 1, 1));
+	svd_w.push_back(identity);
+	svd_v.push_back(identity);
+
+	grid_position.push_back(Vector3r::Zero());
+	spline_weights.push_back(SplineWeights::Zero());
+	spline_slopes.push_back(SplineWeights::Zero());
+
+	id.push_back((int)id.size());
+
+	// Extend the last run, or start a new one
+	int i = size() - 1;
+	if (runs.empty() || runs.back().material != p.material)
+	{
+		MaterialRun run = { i, i, p.material };
+		runs.push_back(run);
+	}
+	runs.back().end = i + 1;
+}
+
+// Gather one field into the new order
+template <typename T>
+static void reorderField(AlignedVector<T>& field, const std::vector<int>& order)
+{
+	AlignedVector<T> sorted(order.size());
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		sorted[i] = field[order[i]];
+	}
+	field.swap(sorted);
+}
+
+void ParticleArrays::reorder(const std::vector<int>& order)
+{
+	reorderField(volume, order);
+	reorderField(mass, order);
+	reorderField(density, order);
+	reorderField(position, order);
+	reorderField(velocity, order);
+	reorderField(velocity_gradient, order);
+	reorderField(inertia_tensor_reverse, order);
+	reorderField(affine_state, order);
+	reorderField(material, order);
+	reorderField(def_elastic, order);
+	reorderField(def_plastic, order);
+	reorderField(plastic_det, order);
+	reorderField(stress, order);
+	reorderField(svd_w, order);
+	reorderField(svd_v, order);
+	reorderField(svd_e, order);
+	reorderField(grid_position, order);
+	reorderField(spline_weights, order);
+	reorderField(spline_slopes, order);
+	reorderField(id, order);
+	groupMaterials();
+}
+
+// Update position, based on velocity
+void ParticleArrays::updatePos(int i, double dt)
+{
+	// Simple euler integration
+	position[i] += dt * velocity[i];
+}
+
+// Update deformation gradient
+void ParticleArrays::updateGradient(int i, double dt)
+{
+	// Initially make all updates elastic
+	velocity_gradient[i] *= dt;
+	diagSum(velocity_gradient[i], 1);
+	def_elastic[i] = velocity_gradient[i] * def_elastic[i];
+}
+
+void ParticleArrays::applyPlasticity(int begin, int end)
+{
+	// Only the last batch of each run can have empty lanes
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		int run_begin = std::max(begin, runs[r].begin),
+			run_end = std::min(end, runs[r].end);
+		if (run_begin < run_end)
+		{
+			plasticityBatches(run_begin, run_end, materials[runs[r].material]);
+		}
+	}
+}
+
+void ParticleArrays::plasticityBatches(int begin, int end, const MaterialConstants& m)
+{
+	typedef Svd3<Real, PARTICLE_LANES> Svd;
+	typedef FixedCorotated<Real, PARTICLE_LANES> Material;
+
+	for (int batch = begin; batch < end; batch += PARTICLE_LANES)
+	{
+		int count = end - batch < PARTICLE_LANES ? end - batch : PARTICLE_LANES;
+
+		// Load the elastic gradients across lanes; missing particles are padded with the identity
+		Svd::Vec a[3][3], u[3][3], e[3], v[3][3];
+		Svd::Vec jp, scale;
+		for (int l = 0; l < PARTICLE_LANES; l++)
+		{
+			bool used = l < count;
+			for (int r = 0; r < 3; r++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					a[r][c][l] = used ? def_elastic[batch + l](r, c) : (Real)(r == c ? 1 : 0);
+				}
+			}
+			jp[l] = used ? plastic_det[batch + l] : 1;
+			scale[l] = used ? volume[batch + l] : 0;
+		}
+
+		// Compute the SVD decomposition
+		// The singular values (basically a scale transform) tell us if 
+		// the particle has exceeded critical stretch/compression
+		Svd::compute(a, u, e, v);
+
+		// Svd3 keeps U and V rotations and moves an inversion into the sign of e[2]
+		// The clamp works on the magnitudes, as with non-negative singular values, and the sign goes back after
+		Svd::Vec sign = selectLess(e[2], (Real)0, (Real)-1, (Real)1);
+		e[2] = abs(e[2]);
+
+		// Clamp singular values to within elastic region
+		// Whatever the clamp takes out of Je moves into Jp
+		Svd::Vec je = e[0] * e[1] * e[2];
+		for (int k = 0; k < 3; k++)
+		{
+			e[k] = min(max(e[k], m.crit_compress), m.crit_stretch);
+		}
+		jp = jp * je / (e[0] * e[1] * e[2]);
+		e[2] = e[2] * sign;
+
+		// Stress for the next step, with plastic hardening
+		Svd::Vec s[3][3];
+		scale = scale * exp(m.hardening * (1 - jp));
+		Material::stress(u, e, m.mu, m.lambda, scale, s);
+
+		for (int l = 0; l < count; l++)
+		{
+			int i = batch + l;
+			Matrix3r& w = svd_w[i];
+			Matrix3r& vt = svd_v[i];
+			for (int r = 0; r < 3; r++)
+			{
+				svd_e[i][r] = e[r][l];
+				for (int c = 0; c < 3; c++)
+				{
+					w(r, c) = u[r][c][l];
+					vt(c, r) = v[r][c][l];
+					stress[i](r, c) = s[r][c][l];
+				}
+			}
+			plastic_det[i] = jp[l];
+
+			// Recompute elastic and plastic gradient
+			// Basically just putting the SVD back together again
+			def_plastic[i] = vt.transpose() * svd_e[i].asDiagonal().inverse() * w.transpose() * def_elastic[i] * def_plastic[i];
+			def_elastic[i] = w * svd_e[i].asDiagonal() * vt;
+		}
+	}
+}
+
+// Linearized stress of the fixed-corotated energy
+// P = 2 mu (Fe - R) + lambda (J - 1) J Fe^-T, so
+// dP = 2 mu (dFe - dR) + lambda (J Fe^-T (J Fe^-T : dFe) + (J - 1) d(J Fe^-T))
+const Matrix3r ParticleArrays::deltaEnergyDerivative(int i, const Matrix3r& delta_def) const
+{
+	const Matrix3r& fe = def_elastic[i];
+	// Polar decomposition Fe = R S, from the cached SVD
+	Matrix3r rotation = svd_w[i] * svd_v[i],
+		stretch = svd_v[i].transpose() * svd_e[i].asDiagonal() * svd_v[i];
+
+	// dR = R W, with W skew; its axial vector w solves (tr(S) I - S) w = axial(R^T dFe - dFe^T R)
+	Matrix3r rf = rotation.transpose() * delta_def;
+	Vector3r axial(rf(2, 1) - rf(1, 2), rf(0, 2) - rf(2, 0), rf(1, 0) - rf(0, 1));
+	Matrix3r system = -stretch;
+	diagSum(system, stretch.trace());
+	Matrix3r delta_rotation = rotation * skew(system.inverse() * axial);
+
+	Real Je = svd_e[i].prod(),
+		 Jp = plastic_det[i];
+	Matrix3r cof = cofactor(fe);
+
+	const MaterialConstants& m = materials[material[i]];
+	Matrix3r delta_stress = 2 * m.mu * (delta_def - delta_rotation)
+		+ m.lambda * (cof * (cof.cwiseProduct(delta_def)).sum() + (Je - 1) * cofactorDelta(fe, delta_def));
+
+	return volume[i] * exp(m.hardening*(1 - Jp)) * delta_stress * fe.transpose();
+}
+
+// Squared speed of elastic (P-)waves in the particle, (lambda + 2 mu) / density
+// The moduli are hardened like the stress, so compacted snow gets the shorter step its stiffer response needs
+Real ParticleArrays::waveSpeedSquared(int i) const
+{
+	const MaterialConstants& m = materials[material[i]];
+	return (m.lambda + 2 * m.mu) * exp(m.hardening * (1 - plastic_det[i])) * volume[i] / mass[i];
+}
\ No newline at end of file
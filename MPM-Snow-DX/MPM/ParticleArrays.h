@@ -0,0 +1,136 @@
+#pragma once
+#ifndef PARTICLEARRAYS_H
+#define PARTICLEARRAYS_H
+
+#include <vector>
+#include <cmath>
+#include "CustomMath.h"
+#include "SimulationParameters.h"
+#include "Particle.h"
+#include "Svd3.h"
+#include "Constitutive.h"
+#include "SimulationConfig.h"
+
+// One-dimensional interpolation weights of a particle: one row per axis, one column per stencil node
+typedef Eigen::Matrix<Real, 3, 4> SplineWeights;
+
+// Particles per batch of the SIMD kernels: one vector register of Real when the build targets AVX2
+// (4 doubles or 8 floats) or AVX-512 (8 or 16); see MPM_AVX2 and MPM_AVX512 in CMakeLists.txt
+#ifdef __AVX512F__
+const int PARTICLE_LANES = sizeof(Real) > 4 ? 8 : 16;
+#else
+const int PARTICLE_LANES = sizeof(Real) > 4 ? 4 : 8;
+#endif
+
+// Constants of one material, in simulation precision
+struct MaterialConstants
+{
+	// Lame parameters
+	Real lambda, mu;
+	// Plasticity: singular values of the elastic gradient are clamped to [crit_compress, crit_stretch],
+	// and plastic compression hardens the snow by exp(hardening * (1 - Jp))
+	Real crit_compress, crit_stretch, hardening;
+};
+
+// Consecutive particles [begin, end) of one material
+struct MaterialRun
+{
+	int begin, end;
+	int material;
+};
+
+// Contiguous storage, aligned for SIMD loads
+template <typename T>
+using AlignedVector = std::vector<T, Eigen::aligned_allocator<T>>;
+
+// Particle state as a structure of arrays: one array per field, indexed by particle
+// Passes only stream the fields they touch, instead of whole particles
+class ParticleArrays
+{
+public:
+	AlignedVector<Real> volume, mass, density;
+	AlignedVector<Vector3r> position, velocity;
+	AlignedVector<Matrix3r> velocity_gradient;
+
+	// APIC: locally affine matrix
+	// The velocity derivatives matrix C equals B*D^-1
+	// namely, affine_state * intertia_tensor_reverse
+	AlignedVector<Matrix3r> inertia_tensor_reverse, affine_state;
+
+	// Material of each particle, an index into materials
+	AlignedVector<int> material;
+
+	// Deformation gradient (elastic and plastic parts)
+	AlignedVector<Matrix3r> def_elastic, def_plastic;
+	// Determinant of def_plastic, kept up to date by applyPlasticity
+	AlignedVector<Real> plastic_det;
+
+	// Stress (energy derivative times the transposed elastic gradient, scaled by volume and hardening),
+	// computed by applyPlasticity for the next step's force transfer
+	AlignedVector<Matrix3r> stress;
+
+	// Cached SVD's for elastic deformation gradient, def_elastic = svd_w * diag(svd_e) * svd_v
+	// (svd_v holds V transposed); both are rotations
+	AlignedVector<Matrix3r> svd_w, svd_v;
+	AlignedVector<Vector3r> svd_e;
+
+	// Grid interpolation weights
+	// Separable: the 4x4x4 stencil weights and gradients are rebuilt from these on the fly
+	AlignedVector<Vector3r> grid_position;
+	AlignedVector<SplineWeights> spline_weights, spline_slopes;
+
+	// Materials of the run, from SimulationConfig::materials
+	std::vector<MaterialConstants> materials;
+
+	// Particles split into runs of one material, in order
+	// Sorting buckets particles by material, so there is usually one run per material
+	std::vector<MaterialRun> runs;
+
+	// Creation index of each particle; follows it through sorts, so exported frames keep a stable order
+	AlignedVector<int> id;
+
+	ParticleArrays();
+	virtual ~ParticleArrays();
+
+	// Take the material settings of a run
+	void configure(const SimulationConfig& config);
+
+	// Rebuild runs from material, after it was filled in directly (e.g. from a checkpoint)
+	void groupMaterials();
+
+	int size() const { return (int)position.size(); }
+	void reserve(int count);
+	// Set the number of particles; new entries are zero and must be filled in (e.g. from a checkpoint)
+	void resize(int count);
+
+	// Append a particle in its rest state
+	void push_back(const Particle& p);
+
+	// Reorder every field; particle i becomes the old particle order[i]
+	// Also regroups the material runs
+	void reorder(const std::vector<int>& order);
+
+	// Update position, based on velocity
+	void updatePos(int i, double dt);
+
+	// Update deformation gradient
+	void updateGradient(int i, double dt);
+
+	// Split the deformation into elastic and plastic parts for particles [begin, end)
+	// Also caches the SVD of the elastic part, Jp and the stress
+	// Runs one material run at a time, so a batch never mixes materials
+	void applyPlasticity(int begin, int end);
+
+	// Change of the stress when the elastic deformation gradient changes by delta_def
+	// Implicit solve: the energy Hessian applied to a deformation, through the particle
+	const Matrix3r deltaEnergyDerivative(int i, const Matrix3r& delta_def) const;
+
+	// Elastic wave speed, squared; bounds the stable timestep
+	Real waveSpeedSquared(int i) const;
+
+private:
+	// applyPlasticity of particles [begin, end), which share material m
+	void plasticityBatches(int begin, int end, const MaterialConstants& m);
+};
+
+#endif // !PARTICLEARRAYS_H
@@ -1,9 +1,8 @@
-#include "pch.h"
 #include "PointCloud.h"
 
-PointCloud::PointCloud() {}
+PointCloud::PointCloud() : thread_pool(NULL) {}
 
-PointCloud::PointCloud(int cloud_size)
+PointCloud::PointCloud(int cloud_size) : thread_pool(NULL)
 {
 	size = cloud_size;
 	particles.reserve(size);
@@ -15,36 +14,140 @@ PointCloud::~PointCloud() {}
 
 
 // Update particle data
-void PointCloud::update()
+void PointCloud::update(double dt)
 {
 	max_velocity = 0;
+	max_wave_speed = 0;
 
-	for (int i = 0; i < size; i++)
+	if (thread_pool == NULL)
 	{
-		particles[i].updatePos();
-		particles[i].updateGradient();
-		particles[i].applyPlasticity();
+		updateRange(0, size, dt, max_velocity, max_wave_speed);
+		return;
+	}
+
+	// Each chunk tracks its own maxima; merge them at the end of the chunk
+	// Chunks are whole batches, so only the last one runs partly empty lanes
+	std::mutex max_mutex;
+	int batches = (size + PARTICLE_LANES - 1) / PARTICLE_LANES;
+	thread_pool->parallelFor(batches, [&](int begin, int end) {
+		double chunk_vel = 0, chunk_wave = 0;
+		updateRange(begin * PARTICLE_LANES, std::min(end * PARTICLE_LANES, size), dt, chunk_vel, chunk_wave);
+
+		std::lock_guard<std::mutex> lock(max_mutex);
+		if (chunk_vel > max_velocity)
+		{
+			max_velocity = chunk_vel;
+		}
+		if (chunk_wave > max_wave_speed)
+		{
+			max_wave_speed = chunk_wave;
+		}
+	});
+}
 
+void PointCloud::updateRange(int begin, int end, double dt, double& max_vel, double& max_wave)
+{
+	for (int i = begin; i < end; i++)
+	{
+		particles.updatePos(i, dt);
+		particles.updateGradient(i, dt);
+	}
+
+	particles.applyPlasticity(begin, end);
+
+	for (int i = begin; i < end; i++)
+	{
 		// Update max velocity, if needed
-		double vel = lengthSquared(particles[i].velocity);
+		double vel = lengthSquared(particles.velocity[i]);
+		if (vel > max_vel)
+		{
+			max_vel = vel;
+		}
+
+		double wave = particles.waveSpeedSquared(i);
+		if (wave > max_wave)
+		{
+			max_wave = wave;
+		}
+	}
+}
+
+// Particle volumes must be known (after Grid::calculateVolumes)
+void PointCloud::measureSpeeds()
+{
+	max_velocity = 0;
+	max_wave_speed = 0;
+
+	for (int i = 0; i < size; i++)
+	{
+		double vel = lengthSquared(particles.velocity[i]),
+			   wave = particles.waveSpeedSquared(i);
 		if (vel > max_velocity)
 		{
 			max_velocity = vel;
 		}
+		if (wave > max_wave_speed)
+		{
+			max_wave_speed = wave;
+		}
 	}
 }
 
 
+// Spread the low 21 bits of v so that there are two zero bits between each
+static uint64_t spreadBits(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffff;
+	v = (v | v << 16) & 0x1f0000ff0000ff;
+	v = (v | v << 8) & 0x100f00f00f00f00f;
+	v = (v | v << 4) & 0x10c30c30c30c30c3;
+	v = (v | v << 2) & 0x1249249249249249;
+	return v;
+}
+
+// Sort particles by material, then by the Morton code of their grid cell
+void PointCloud::sortParticles(const Vector3r& origin, const Vector3r& cellsize)
+{
+	// One bucket of keys per material
+	std::vector<std::vector<std::pair<uint64_t, int> > > buckets(particles.materials.size());
+	for (int i = 0; i < size; i++)
+	{
+		Vector3r cell = division(particles.position[i] - origin, cellsize);
+		uint64_t code = 0;
+		for (int d = 0; d < 3; d++)
+		{
+			// Particles are inside the grid; clamp anyway so stray ones cannot wrap around
+			uint64_t c = cell[d] > 0 ? (uint64_t)cell[d] : 0;
+			code |= spreadBits(c) << d;
+		}
+		buckets[particles.material[i]].push_back(std::make_pair(code, i));
+	}
+
+	std::vector<int> order;
+	order.reserve(size);
+	for (size_t m = 0; m < buckets.size(); m++)
+	{
+		// Ties keep their index order, so the result is deterministic
+		std::sort(buckets[m].begin(), buckets[m].end());
+		for (size_t k = 0; k < buckets[m].size(); k++)
+		{
+			order.push_back(buckets[m][k].second);
+		}
+	}
+	particles.reorder(order);
+}
+
 // Get bounding box [vertex a, vertex b]
-void PointCloud::bounds(Eigen::Vector3d points[2])
+void PointCloud::bounds(Vector3r points[2])
 {
-	points[0](0) = particles[0].position(0); points[1](0) = points[0](0);
-	points[0](1) = particles[0].position(1); points[1](1) = points[0](1);
-	points[0](2) = particles[0].position(2); points[1](2) = points[0](2);
+	points[0](0) = particles.position[0](0); points[1](0) = points[0](0);
+	points[0](1) = particles.position[0](1); points[1](1) = points[0](1);
+	points[0](2) = particles.position[0](2); points[1](2) = points[0](2);
 
 	for (int i = 0; i<size; i++)
 	{
-		Eigen::Vector3d& p = particles[i].position;
+		Vector3r& p = particles.position[i];
 		// X-bounds
 		if (p(0) < points[0](0))
 			points[0](0) = p(0);
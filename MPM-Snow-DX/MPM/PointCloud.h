@@ -3,11 +3,16 @@
 #define POINTCLOUD_H
 
 #include <vector>
+#include <cstdlib>
+#include <mutex>
+#include <algorithm>
+#include <stdint.h>
 
 #include "SimulationParameters.h"
 #include "Particle.h"
+#include "ParticleArrays.h"
 #include "Entity.h"
-#include "..\Content\ShaderStructures.h"
+#include "ThreadPool.h"
 
 
 #define VOLUME_EPSILON 1e-5
@@ -21,8 +26,12 @@ class PointCloud
 {
 public:
 	int size;
-	double max_velocity;
-	std::vector<Particle> particles;
+	// Squared maximum particle speed and elastic wave speed, from the last update
+	double max_velocity, max_wave_speed;
+	ParticleArrays particles;
+
+	// Workers for the particle update; NULL runs it serially
+	ThreadPool* thread_pool;
 
 	PointCloud();
 	PointCloud(int cloud_size);
@@ -30,13 +39,21 @@ public:
 	virtual ~PointCloud();
 
 	// Update particle data
-	void update();
+	void update(double dt);
+
+	// Recompute max_velocity and max_wave_speed without advancing the particles
+	void measureSpeeds();
+
+	// Sort particles by material, then by the Morton (Z-order) code of their grid cell
+	// Neighbouring particles then share grid nodes and cache lines during transfers,
+	// and each material is one run for the plasticity batches
+	void sortParticles(const Vector3r& origin, const Vector3r& cellsize);
 
 	// Get bounding box [vertex a, vertex b]
-	void bounds(Eigen::Vector3d points[2]);
+	void bounds(Vector3r points[2]);
 
-	// Generate particles that fill a set of shapes
-	static PointCloud* createEntity(std::vector<Entity*>& snow_entities) {
+	// Generate particles that fill a set of shapes, with the spacing and materials of config
+	static PointCloud* createEntity(std::vector<Entity*>& snow_entities, const SimulationConfig& config = SimulationConfig()) {
 
 		// Compute area of all the snow entities
 		double volume = 0;
@@ -58,13 +75,15 @@ public:
 
 		// Otherwise, create the object
 		// Calculate particle settings
-		double particle_volume = PARTICLE_DIAM * PARTICLE_DIAM * PARTICLE_DIAM,
-			   particle_mass = particle_volume * DENSITY;
+		double particle_diam = config.particle_diameter,
+			   particle_volume = particle_diam * particle_diam * particle_diam,
+			   particle_mass = particle_volume * config.density;
 
 		int particles = volume / particle_volume;
 
 		// Randomly scatter points
 		PointCloud *obj = new PointCloud(particles);
+		obj->particles.configure(config);
 
 		Eigen::Vector3d bounds[2];
 		int shape_num = 0, total_points = 0;
@@ -90,14 +109,7 @@ public:
 
 				total_points += points;
 
-				// Estimate the centroid of the shape with the bounds
 				snow_entities[i]->bounds(bounds);
-				double cx = (bounds[0](0) + bounds[1](0)) / 2.0,
-					   cy = (bounds[0](1) + bounds[1](1)) / 2.0,
-					   cz = (bounds[0](2) + bounds[1](2)) / 2.0,
-					   cw = bounds[1](0) - cx,
-					   ch = bounds[1](1) - cy,
-				       cs = bounds[1](2) - cz;
 
 				// Randomly scatter points in the shape until the quota is met
 				int points_found = 0;
@@ -112,14 +124,8 @@ public:
 					// Check if this point is inside the shape
 					if (snow_entities[i]->contains(tx, ty, tz))
 					{
-						// Randomly adjust hardness of snow
-						double adjust = (rand() / (double)RAND_MAX) * 10;
-
-						// Make snow hardest on the outer edges
-						adjust *= ((fabs(tx - cx) / cw) + (fabs(ty - cy) / ch) + (fabs(tz - cz) / cs)) / 2.0;
-
 						// Add the snow particle
-						obj->particles.push_back(Particle(Eigen::Vector3d(tx, ty, tz), Eigen::Vector3d(vel), particle_mass, LAMBDA, MU));
+						obj->particles.push_back(Particle(Eigen::Vector3d(tx, ty, tz), Eigen::Vector3d(vel), particle_mass, snow_entities[i]->material));
 
 						points_found++;
 					}
@@ -129,10 +135,14 @@ public:
 
 		// Set initial max velocity
 		obj->max_velocity = max_vel;
+		obj->max_wave_speed = 0;
 
 		return obj;
 	}
 
+private:
+	// Advance particles [begin, end) and fold their speeds into the maxima
+	void updateRange(int begin, int end, double dt, double& max_vel, double& max_wave);
 };
 
 #endif
\ No newline at end of file
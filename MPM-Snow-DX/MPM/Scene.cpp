@@ -1,6 +1,7 @@
-#include "pch.h"
 #include "Scene.h"
 
+#include <stdio.h>
+
 Scene::Scene() {}
 Scene::Scene(const Scene& scene) {}
 Scene::~Scene() {}
@@ -149,5 +150,217 @@ Scene* Scene::GenerateScene(int index)
 	}
 	}
 
+	return scene;
+}
+
+
+// Scene files are line based: a keyword and its values, separated by whitespace; # starts a comment
+//
+//   sphere center x y z radius r [velocity x y z] [material name]
+//   cube center x y z size s | size x y z [velocity x y z] [material name]
+//
+// Every other line sets a SimulationConfig key, for example
+//
+//   domain x y z              size of the simulated box, in meters
+//   origin x y z              its lower corner
+//   cells x y z               grid resolution
+//   gravity x y z
+//   timestep dt | adaptive [max_dt]
+//   particle_diameter d       smaller = more particles
+//   density rho
+//   youngs_modulus E
+//   poissons_ratio nu
+//   hardening h, critical_compression c, critical_stretch s, sticky s
+//   material name key value...  a material for shapes to use; starts as a copy of the default one,
+//                               e.g. material wet youngs_modulus 5e4 hardening 5
+//   kernel cubic | quadratic
+//   implicit_solve on | off
+//
+// (see SimulationConfig::set for the full list)
+
+// Count the numbers starting at tokens[at]
+static int countNumbers(const std::vector<std::string>& tokens, size_t at)
+{
+	double value;
+	int count = 0;
+	while (at + count < tokens.size() && SimulationConfig::parseNumber(tokens[at + count], value))
+	{
+		count++;
+	}
+	return count;
+}
+
+// Read count numbers starting at tokens[at]; they have been counted already
+static void readNumbers(const std::vector<std::string>& tokens, size_t at, double* values, int count)
+{
+	for (int k = 0; k < count; k++)
+	{
+		SimulationConfig::parseNumber(tokens[at + k], values[k]);
+	}
+}
+
+// Entity line: shape keyword, then attribute names with their values in any order
+// Materials must be defined before the shapes that use them
+static Entity* parseEntity(const std::vector<std::string>& tokens, const SimulationConfig& config, std::string& error)
+{
+	bool sphere = tokens[0] == "sphere";
+	bool has_center = false, has_size = false;
+	double center[3], size[3], velocity[3] = { 0, 0, 0 };
+	int material = 0;
+
+	for (size_t t = 1; t < tokens.size();)
+	{
+		const std::string& name = tokens[t++];
+		int count = countNumbers(tokens, t);
+		if (name == "material" && t < tokens.size())
+		{
+			material = config.findMaterial(tokens[t]);
+			if (material < 0)
+			{
+				error = "unknown material '" + tokens[t] + "'";
+				return NULL;
+			}
+			t++;
+			continue;
+		}
+		if (name == "center" && count == 3)
+		{
+			readNumbers(tokens, t, center, 3);
+			has_center = true;
+		}
+		else if (name == "velocity" && count == 3)
+		{
+			readNumbers(tokens, t, velocity, 3);
+		}
+		else if (sphere && name == "radius" && count == 1)
+		{
+			readNumbers(tokens, t, size, 1);
+			has_size = true;
+		}
+		else if (!sphere && name == "size" && (count == 1 || count == 3))
+		{
+			readNumbers(tokens, t, size, count);
+			if (count == 1)
+			{
+				size[1] = size[2] = size[0];
+			}
+			has_size = true;
+		}
+		else
+		{
+			error = "bad " + tokens[0] + " attribute '" + name + "'";
+			return NULL;
+		}
+		t += count;
+	}
+
+	if (!has_center || !has_size)
+	{
+		error = tokens[0] + (sphere ? " needs center and radius" : " needs center and size");
+		return NULL;
+	}
+	if (size[0] <= 0 || (!sphere && (size[1] <= 0 || size[2] <= 0)))
+	{
+		error = tokens[0] + " must have a positive size";
+		return NULL;
+	}
+
+	Eigen::Vector3d c(center[0], center[1], center[2]), v(velocity[0], velocity[1], velocity[2]);
+	Entity* entity = sphere ? Entity::generateSnowball(c, size[0], v)
+		: Entity::generateSnowcube(c, Eigen::Vector3d(size[0], size[1], size[2]), v);
+	entity->material = material;
+	return entity;
+}
+
+// Shapes must fit in the domain, with one layer of grid cells around them
+static bool validateEntities(const Scene* scene, std::string& error)
+{
+	const SimulationConfig& config = scene->config;
+	if (scene->snow_entities.empty())
+	{
+		error = "no sphere or cube";
+		return false;
+	}
+
+	Eigen::Vector3d cellsize = division(config.dims, config.cells);
+	for (size_t i = 0; i < scene->snow_entities.size(); i++)
+	{
+		// Entity::bounds is loose for cubes
+		const Entity* entity = scene->snow_entities[i];
+		for (int d = 0; d < 3; d++)
+		{
+			double half = entity->type == Entity::Sphere ? entity->radius : entity->edge_length[d] / 2;
+			if (entity->center(d) - half < config.origin(d) + cellsize(d)
+				|| entity->center(d) + half > config.origin(d) + config.dims(d) - cellsize(d))
+			{
+				char message[64];
+				snprintf(message, sizeof(message), "shape %d reaches outside the domain", (int)i + 1);
+				error = message;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+Scene* Scene::LoadScene(const char* path, std::string& error)
+{
+	FILE* file = fopen(path, "r");
+	if (file == NULL)
+	{
+		error = std::string(path) + ": cannot open";
+		return NULL;
+	}
+
+	Scene* scene = new Scene();
+	char line[1024];
+	int number = 0;
+	bool ok = true;
+	std::vector<std::string> tokens;
+	while (ok && fgets(line, sizeof(line), file) != NULL)
+	{
+		number++;
+		SimulationConfig::tokenize(line, tokens);
+		if (tokens.empty())
+		{
+			continue;
+		}
+
+		if (tokens[0] == "sphere" || tokens[0] == "cube")
+		{
+			Entity* entity = parseEntity(tokens, scene->config, error);
+			ok = entity != NULL;
+			if (ok)
+			{
+				scene->snow_entities.push_back(entity);
+			}
+		}
+		else
+		{
+			ok = scene->config.set(tokens, error);
+		}
+
+		if (!ok)
+		{
+			error = std::string(path) + ":" + std::to_string(number) + ": " + error;
+		}
+	}
+	fclose(file);
+
+	if (ok && !(scene->config.validate(error) && validateEntities(scene, error)))
+	{
+		error = std::string(path) + ": " + error;
+		ok = false;
+	}
+	if (!ok)
+	{
+		for (size_t i = 0; i < scene->snow_entities.size(); i++)
+		{
+			delete scene->snow_entities[i];
+		}
+		delete scene;
+		return NULL;
+	}
+
 	return scene;
 }
\ No newline at end of file
@@ -3,19 +3,27 @@
 #define SCENE_H
 
 #include <stdlib.h>
+#include <string>
 #include "Entity.h"
+#include "SimulationConfig.h"
 
 class Scene
 {
 public:
 	std::vector<Entity*> snow_entities;
 
+	// Domain, material, timestep and transfer settings
+	SimulationConfig config;
+
 	Scene();
 	Scene(const Scene&);
 	virtual ~Scene();
 
 	static Scene* GenerateScene(int); // 0-Snow ball smash;
 
+	// Read a scene description file (format in Scene.cpp, examples in Scenes/)
+	// Returns NULL on failure, with the file, line and reason in error
+	static Scene* LoadScene(const char* path, std::string& error);
 };
 
-#endif // !SCENE_H
+#endif // !SCENE_H
\ No newline at end of file
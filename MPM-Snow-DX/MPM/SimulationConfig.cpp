@@ -0,0 +1,316 @@
+#include "SimulationConfig.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+
+SnowMaterial::SnowMaterial() :
+	name("snow"),
+	youngs_modulus(YOUNGS_MODULUS),
+	poissons_ratio(POISSONS_RATIO),
+	crit_compress(CRIT_COMPRESS),
+	crit_stretch(CRIT_STRETCH),
+	hardening(HARDENING)
+{
+}
+
+double SnowMaterial::lambda() const
+{
+	return youngs_modulus * poissons_ratio / ((1 + poissons_ratio) * (1 - 2 * poissons_ratio));
+}
+
+double SnowMaterial::mu() const
+{
+	return youngs_modulus / (2 + 2 * poissons_ratio);
+}
+
+SimulationConfig::SimulationConfig() :
+	origin(0, 0, 0),
+	dims(WIN_METERS_X, WIN_METERS_Y, WIN_METERS_Z),
+	cells(GRID_RES_X, GRID_RES_Y, GRID_RES_Z),
+	particle_diameter(PARTICLE_DIAM),
+	density(DENSITY),
+	materials(1),
+	sticky(STICKY),
+	gravity(GRAVITY),
+	timestep(TIMESTEP),
+	max_timestep(MAX_TIMESTEP),
+	adaptive_timestep(ADAPTIVE_TIMESTEP),
+	cfl_number(CFL_NUMBER),
+	elastic_cfl(ELASTIC_CFL),
+	kernel(DEFAULT_KERNEL),
+	closed_form_inertia(CLOSED_FORM_INERTIA),
+	mls_transfer(MLS_TRANSFER),
+	implicit_solve(IMPLICIT_SOLVE),
+	implicit_ratio(IMPLICIT_RATIO),
+	implicit_tolerance(MAX_IMPLICIT_ERR),
+	implicit_iterations(MAX_IMPLICIT_ITERS),
+	sort_interval(SORT_INTERVAL)
+{
+}
+
+int SimulationConfig::findMaterial(const std::string& name) const
+{
+	for (size_t m = 0; m < materials.size(); m++)
+	{
+		if (materials[m].name == name)
+		{
+			return (int)m;
+		}
+	}
+	return -1;
+}
+
+void SimulationConfig::scaleResolution(double factor)
+{
+	for (int d = 0; d < 3; d++)
+	{
+		cells(d) = std::max(1.0, floor(cells(d) * factor + 0.5));
+	}
+	particle_diameter /= factor;
+}
+
+
+void SimulationConfig::tokenize(const std::string& line, std::vector<std::string>& tokens)
+{
+	std::istringstream words(line.substr(0, line.find('#')));
+	std::string token;
+	tokens.clear();
+	while (words >> token)
+	{
+		tokens.push_back(token);
+	}
+}
+
+bool SimulationConfig::parseNumber(const std::string& token, double& value)
+{
+	char* end;
+	value = strtod(token.c_str(), &end);
+	return !token.empty() && *end == 0;
+}
+
+// Material setting called key, or NULL
+static double* materialSetting(SnowMaterial& material, const std::string& key)
+{
+	if (key == "youngs_modulus") return &material.youngs_modulus;
+	if (key == "poissons_ratio") return &material.poissons_ratio;
+	if (key == "critical_compression") return &material.crit_compress;
+	if (key == "critical_stretch") return &material.crit_stretch;
+	if (key == "hardening") return &material.hardening;
+	return NULL;
+}
+
+static bool parseSwitch(const std::string& token, bool& value)
+{
+	if (token == "on" || token == "true" || token == "1") value = true;
+	else if (token == "off" || token == "false" || token == "0") value = false;
+	else return false;
+	return true;
+}
+
+bool SimulationConfig::set(const std::string& line, std::string& error)
+{
+	std::vector<std::string> tokens;
+	tokenize(line, tokens);
+	if (tokens.empty())
+	{
+		error = "empty setting";
+		return false;
+	}
+	return set(tokens, error);
+}
+
+bool SimulationConfig::set(const std::vector<std::string>& tokens, std::string& error)
+{
+	const std::string& key = tokens[0];
+	size_t values = tokens.size() - 1;
+	double v[3];
+
+	Eigen::Vector3d* vector = NULL;
+	if (key == "domain") vector = &dims;
+	else if (key == "origin") vector = &origin;
+	else if (key == "cells") vector = &cells;
+	else if (key == "gravity") vector = &gravity;
+	if (vector != NULL)
+	{
+		if (values != 3 || !parseNumber(tokens[1], v[0]) || !parseNumber(tokens[2], v[1]) || !parseNumber(tokens[3], v[2]))
+		{
+			error = key + " needs three numbers";
+			return false;
+		}
+		*vector = Eigen::Vector3d(v[0], v[1], v[2]);
+		return true;
+	}
+
+	if (key == "timestep")
+	{
+		if (values >= 1 && tokens[1] == "adaptive")
+		{
+			adaptive_timestep = true;
+			if (values == 1) return true;
+			if (values == 2 && parseNumber(tokens[2], max_timestep)) return true;
+		}
+		else if (values == 1 && parseNumber(tokens[1], timestep))
+		{
+			adaptive_timestep = false;
+			return true;
+		}
+		error = "timestep needs a step length, or 'adaptive' and an optional limit";
+		return false;
+	}
+
+	if (key == "kernel")
+	{
+		if (values == 1 && tokens[1] == "cubic") kernel = KERNEL_CUBIC;
+		else if (values == 1 && tokens[1] == "quadratic") kernel = KERNEL_QUADRATIC;
+		else
+		{
+			error = "kernel is cubic or quadratic";
+			return false;
+		}
+		return true;
+	}
+
+	// material name [key value]...: a new material starts out as a copy of the default one
+	if (key == "material")
+	{
+		if (values < 1 || values % 2 != 1)
+		{
+			error = "material needs a name, then material keys and their values";
+			return false;
+		}
+		SnowMaterial material = materials[0];
+		int index = findMaterial(tokens[1]);
+		if (index >= 0)
+		{
+			material = materials[index];
+		}
+		material.name = tokens[1];
+		for (size_t t = 2; t < tokens.size(); t += 2)
+		{
+			double* setting = materialSetting(material, tokens[t]);
+			if (setting == NULL || !parseNumber(tokens[t + 1], *setting))
+			{
+				error = "bad material setting '" + tokens[t] + " " + tokens[t + 1] + "'";
+				return false;
+			}
+		}
+		if (index >= 0) materials[index] = material;
+		else materials.push_back(material);
+		return true;
+	}
+
+	bool* flag = NULL;
+	if (key == "closed_form_inertia") flag = &closed_form_inertia;
+	else if (key == "mls_transfer") flag = &mls_transfer;
+	else if (key == "implicit_solve") flag = &implicit_solve;
+	if (flag != NULL)
+	{
+		if (values != 1 || !parseSwitch(tokens[1], *flag))
+		{
+			error = key + " is on or off";
+			return false;
+		}
+		return true;
+	}
+
+	int* count = NULL;
+	if (key == "implicit_iterations") count = &implicit_iterations;
+	else if (key == "sort_interval") count = &sort_interval;
+	if (count != NULL)
+	{
+		if (values != 1 || !parseNumber(tokens[1], v[0]) || v[0] != floor(v[0]) || v[0] < 0)
+		{
+			error = key + " needs a whole number";
+			return false;
+		}
+		*count = (int)v[0];
+		return true;
+	}
+
+	double* scalar = materialSetting(materials[0], key);
+	if (key == "particle_diameter") scalar = &particle_diameter;
+	else if (key == "density") scalar = &density;
+	else if (key == "sticky") scalar = &sticky;
+	else if (key == "cfl") scalar = &cfl_number;
+	else if (key == "elastic_cfl") scalar = &elastic_cfl;
+	else if (key == "implicit_ratio") scalar = &implicit_ratio;
+	else if (key == "implicit_tolerance") scalar = &implicit_tolerance;
+	if (scalar == NULL)
+	{
+		error = "unknown keyword '" + key + "'";
+		return false;
+	}
+	if (values != 1 || !parseNumber(tokens[1], *scalar))
+	{
+		error = key + " needs one number";
+		return false;
+	}
+	return true;
+}
+
+bool SimulationConfig::validate(std::string& error) const
+{
+	// Comparisons are written so NaN fails them too
+	double nodes = 1;
+	for (int d = 0; d < 3; d++)
+	{
+		if (!(dims(d) > 0) || !(cells(d) >= 1) || cells(d) != floor(cells(d)) || !std::isfinite(origin(d)))
+		{
+			error = "domain and cells must be positive, with whole numbers of cells";
+			return false;
+		}
+		nodes *= cells(d) + 1;
+	}
+	// Grid indices are ints
+	if (nodes > 2147483647.0)
+	{
+		error = "the grid has too many cells";
+		return false;
+	}
+	if (!(particle_diameter > 0) || !(density > 0) || !(timestep > 0) || !(max_timestep > 0)
+		|| !(cfl_number > 0) || !(elastic_cfl > 0))
+	{
+		error = "particle_diameter, density, timesteps and CFL numbers must be positive";
+		return false;
+	}
+	if (implicit_ratio < 0 || implicit_ratio > 1)
+	{
+		error = "implicit_ratio must be in [0, 1]";
+		return false;
+	}
+	if (implicit_tolerance <= 0 || implicit_iterations <= 0)
+	{
+		error = "implicit_tolerance and implicit_iterations must be positive";
+		return false;
+	}
+	for (size_t m = 0; m < materials.size(); m++)
+	{
+		const SnowMaterial& material = materials[m];
+		// Errors in the default material name the key alone, as it is set without the material keyword
+		std::string prefix = m == 0 ? "" : "material " + material.name + ": ";
+		if (material.youngs_modulus <= 0)
+		{
+			error = prefix + "youngs_modulus must be positive";
+			return false;
+		}
+		if (material.poissons_ratio < 0 || material.poissons_ratio >= 0.5)
+		{
+			error = prefix + "poissons_ratio must be in [0, 0.5)";
+			return false;
+		}
+		if (material.crit_compress <= 0 || material.crit_compress > 1 || material.crit_stretch < 1)
+		{
+			error = prefix + "critical_compression must be in (0, 1] and critical_stretch at least 1";
+			return false;
+		}
+		if (material.hardening < 0)
+		{
+			error = prefix + "hardening must not be negative";
+			return false;
+		}
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+#ifndef SIMULATIONCONFIG_H
+#define SIMULATIONCONFIG_H
+
+#include <string>
+#include <vector>
+#include <Eigen/Dense>
+
+#include "SimulationParameters.h"
+#include "Kernel.h"
+
+// Snow material: elasticity, fracture thresholds and hardening
+// Shapes of a scene may each use a different one (see Entity::material)
+struct SnowMaterial
+{
+	std::string name;
+	double youngs_modulus, poissons_ratio;
+	// Fracture thresholds of the singular values, and how much plastic compression hardens the snow
+	double crit_compress, crit_stretch, hardening;
+
+	// Defaults from SimulationParameters
+	SnowMaterial();
+
+	// Lame parameters
+	double lambda() const;
+	double mu() const;
+};
+
+// Settings of one simulation run, handed to Simulator, Grid and ParticleArrays
+// Starts out from SimulationParameters; scene files and the command line change single keys with set()
+// Only the precision stays a build option (see CustomMath.h)
+struct SimulationConfig
+{
+	// Domain: the grid box and its resolution in cells
+	Eigen::Vector3d origin, dims, cells;
+
+	// Particle spacing and density
+	double particle_diameter, density;
+	// Materials; shapes without one use the first, named "snow"
+	std::vector<SnowMaterial> materials;
+	// Collision stickiness (lower = stickier)
+	double sticky;
+	Eigen::Vector3d gravity;
+
+	// Step length: fixed, or picked from the CFL condition up to max_timestep
+	double timestep, max_timestep;
+	bool adaptive_timestep;
+	double cfl_number, elastic_cfl;
+
+	// Transfers (see Grid)
+	KernelType kernel;
+	bool closed_form_inertia, mls_transfer;
+	bool implicit_solve;
+	double implicit_ratio, implicit_tolerance;
+	int implicit_iterations;
+	// Steps between particle sorts (0 = only at startup)
+	int sort_interval;
+
+	SimulationConfig();
+
+	// Index of the material called name, or -1
+	int findMaterial(const std::string& name) const;
+
+	// Scale grid resolution and particle spacing together: 2 doubles the cells per axis
+	// (and gives 8 times the particles), 0.5 makes a quick preview of the same scene
+	void scaleResolution(double factor);
+
+	// Change one setting from a keyword and its values, e.g. { "cells", "128", "64", "64" }
+	// Material keys change the default material; "material name key value..." adds or changes another
+	// Returns false, with the reason in error, for unknown keywords and malformed values
+	bool set(const std::vector<std::string>& tokens, std::string& error);
+	// Same, from one line of text
+	bool set(const std::string& line, std::string& error);
+
+	// Settings the simulation cannot run with
+	bool validate(std::string& error) const;
+
+	// Split a line into words, dropping # comments
+	static void tokenize(const std::string& line, std::vector<std::string>& tokens);
+	static bool parseNumber(const std::string& token, double& value);
+};
+
+#endif // !SIMULATIONCONFIG_H
\ No newline at end of file
@@ -2,7 +2,7 @@
 #ifndef SIMPARAMETERS_H
 #define SIMPARAMETERS_H
 
-#include <Eigen\Dense>
+#include <Eigen/Dense>
 
 static const double
 PARTICLE_DIAM = 0.005,		// Diameter of each particle; smaller = higher resolution
@@ -14,12 +14,52 @@ DENSITY = 400,				// Density of snow in kg/m^3
 YOUNGS_MODULUS = 1.4e5,		// Young's modulus (springiness) (1.4e5)
 POISSONS_RATIO = 0.2,		// Poisson's ratio (transverse/axial strain ratio) (.2)
 STICKY = 0.5,				// Collision stickiness (lower = stickier)
-TIMESTEP = 0.00005;			// Simulation timestep
+TIMESTEP = 0.00005,			// Simulation timestep when it is not adaptive
+CFL_NUMBER = 0.4,			// Adaptive timestep: fraction of a cell a particle may cross per step
+ELASTIC_CFL = 0.3;			// Adaptive timestep: fraction of a cell an elastic wave may cross per step
 
-// Hardening parameters
+// APIC: use the analytic inertia tensor of the B-spline kernel instead of accumulating it per particle
+static const bool CLOSED_FORM_INERTIA = true;
+
+// Use the MLS-MPM transfer: stress goes into the affine momentum and no separate force pass is run
+static const bool MLS_TRANSFER = false;
+
+// Semi-implicit grid velocity solve
+// The ratio blends explicit (0) and fully implicit (1) forces; the solve stops once the
+// mass-weighted residual falls below MAX_IMPLICIT_ERR of the explicit velocities
+static const bool IMPLICIT_SOLVE = false;
+static const double
+IMPLICIT_RATIO = 1.0,
+MAX_IMPLICIT_ERR = 1e-4;
+static const int MAX_IMPLICIT_ITERS = 30;
+
+// Pick the timestep from the CFL condition every step, up to MAX_TIMESTEP
+static const bool ADAPTIVE_TIMESTEP = true;
+
+// Steps between Morton-order particle sorts; 0 only sorts once, at startup
+static const int SORT_INTERVAL = 20;
+
+// Record per-step phase timings and counts in Simulator (see StepStats)
+static const bool PROFILE_STEPS = false;
+
+// Steps between periodic checkpoints, when Simulator has a CheckpointWriter
+static const int CHECKPOINT_INTERVAL = 1000;
+
+// Steps between exported frames, when Simulator has a FrameExporter
+static const int EXPORT_INTERVAL = 20;
+
+// Compressed frame export (see FrameCodec): position bits per axis across the grid, quantisation steps
+// of the other fields, and frames between keyframes
+static const int
+EXPORT_POSITION_BITS = 16,
+EXPORT_KEY_INTERVAL = 30;
 static const double
-LAMBDA = YOUNGS_MODULUS * POISSONS_RATIO / ((1 + POISSONS_RATIO)*(1 - 2 * POISSONS_RATIO)),
-MU = YOUNGS_MODULUS / (2 + 2 * POISSONS_RATIO);
+EXPORT_VELOCITY_STEP = 1e-3,	// m/s
+EXPORT_DENSITY_STEP = 1e-2,		// kg/m^3
+EXPORT_VOLUME_STEP = 1e-4;		// Of one particle's volume at the configured diameter
+
+// Worker threads for the transfers and particle updates; 0 uses one per hardware thread
+static const int WORKER_THREADS = 0;
 
 static const Eigen::Vector3d GRAVITY = Eigen::Vector3d(0, -9.8, 0);
 
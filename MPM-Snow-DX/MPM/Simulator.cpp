@@ -1,51 +1,193 @@
-#include "pch.h"
 #include "Simulator.h"
 
-Simulator::Simulator(Scene* scene) {
+Simulator::Simulator(Scene* scene, int workers) : Simulator(scene->config, scene->snow_entities, workers) {}
 
+Simulator::Simulator(const SimulationConfig& config, std::vector<Entity*>& snow_entities, int workers) :
+	grid(NULL), thread_pool(NULL), config(config)
+{
 	// Convert entities to snow particles
-	point_cloud = PointCloud::createEntity(scene->snow_entities);
+	point_cloud = PointCloud::createEntity(snow_entities, config);
 	if (point_cloud == NULL)
 	{
 		return;
 	}
 
 	// Grid Initialization
-	grid = new Grid(
-		Eigen::Vector3d(0, 0, 0), 
-		Eigen::Vector3d(WIN_METERS_X, WIN_METERS_Y, WIN_METERS_Z), 
-		Eigen::Vector3d(GRID_RES_X, GRID_RES_Y, GRID_RES_Z), 
-		point_cloud);
+	grid = new Grid(config, point_cloud);
+
+	initialize(workers);
+
+	// Spatially coherent particle order for the transfers
+	point_cloud->sortParticles(grid->origin, grid->cellsize);
 
 	grid->initializeMass();
 	grid->calculateVolumes();
+	point_cloud->measureSpeeds();
+}
+
+Simulator::Simulator(const SimulationConfig& config, PointCloud* cloud, Grid* grid, int workers) :
+	grid(grid), point_cloud(cloud), config(config)
+{
+	initialize(workers);
+}
+
+void Simulator::initialize(int workers)
+{
+	// Workers for the parallel transfers and particle updates
+	thread_pool = new ThreadPool(workers);
+	grid->thread_pool = thread_pool;
+	point_cloud->thread_pool = thread_pool;
+
+	step = 0;
+	time = 0;
+	timestep = config.timestep;
+	profiling = PROFILE_STEPS;
+	trace = NULL;
+	checkpoints = NULL;
+	checkpoint_interval = CHECKPOINT_INTERVAL;
+	exporter = NULL;
+	export_interval = EXPORT_INTERVAL;
+	resetPhaseTimes();
 }
 
-// Copy constructor
-Simulator::Simulator(const Simulator& orig) {}
-Simulator::~Simulator() {}
+// The grid, particles and workers are owned; trace, checkpoints and exporter are not
+Simulator::~Simulator()
+{
+	delete thread_pool;
+	delete grid;
+	delete point_cloud;
+}
 
 
 void Simulator::update()
 {
-	// Rasterize particle mass
-	grid->initializeMass();
+	Clock::time_point start;
+	if (profiling)
+	{
+		stats = StepStats();
+		start = Clock::now();
+	}
 
-	// APIC: initialize inertia tensor
-	grid->initializeInertiaTensor();
+	// Particles drift apart over time; restore Z-order every few steps
+	if (config.sort_interval > 0 && step > 0 && step % config.sort_interval == 0)
+	{
+		point_cloud->sortParticles(grid->origin, grid->cellsize);
+	}
+	step++;
+
+	// Speeds are from the end of the last step
+	if (config.adaptive_timestep)
+	{
+		timestep = computeTimestep();
+	}
+	double dt = timestep;
+	endPhase(PHASE_SORT, start);
 
-	// Rasterize particle velocity
-	grid->initializeVelocities();
+	// Rasterize particle mass and velocity
+	// APIC: the inertia tensor is computed in the same pass
+	grid->particleToGrid(dt);
+	endPhase(PHASE_TO_GRID, start);
 
 	// Compute grid velocities
-	grid->explicitVelocities(GRAVITY);
+	grid->explicitVelocities(config.gravity.cast<Accum>(), dt);
+	endPhase(PHASE_GRID, start);
+	if (grid->implicit_solve)
+	{
+		grid->implicitVelocities(dt);
+		endPhase(PHASE_IMPLICIT, start);
+	}
 
 	// APIC: update affine state
 	grid->updateAffineState();
 
 	// Map back to particles
-	grid->updateVelocities();
+	grid->updateVelocities(dt);
+	endPhase(PHASE_TO_PARTICLES, start);
 
 	// Update particle data
-	point_cloud->update();
+	point_cloud->update(dt);
+	endPhase(PHASE_PARTICLES, start);
+
+	time += dt;
+
+	if (profiling)
+	{
+		recordStep();
+	}
+
+	// Periodic snapshot; the writer copies the state and saves it in the background
+	if (checkpoints != NULL && checkpoint_interval > 0 && step % checkpoint_interval == 0)
+	{
+		checkpoints->snapshot(*this);
+	}
+	if (exporter != NULL && export_interval > 0 && step % export_interval == 0)
+	{
+		exporter->snapshot(*this);
+	}
+}
+
+double Simulator::computeTimestep() const
+{
+	double h = grid->cellsize.minCoeff(),
+		   dt = config.max_timestep;
+
+	// Advection: particles stay within their stencil
+	double speed = sqrt(point_cloud->max_velocity);
+	if (speed * dt > config.cfl_number * h)
+	{
+		dt = config.cfl_number * h / speed;
+	}
+
+	// Elasticity: explicit integration is only stable while waves cross less than a cell per step
+	// The implicit solve lifts this limit
+	double wave = sqrt(point_cloud->max_wave_speed);
+	if (!grid->implicit_solve && wave * dt > config.elastic_cfl * h)
+	{
+		dt = config.elastic_cfl * h / wave;
+	}
+
+	return dt;
+}
+
+
+void Simulator::resetPhaseTimes()
+{
+	for (int i = 0; i < PHASE_COUNT; i++)
+	{
+		phase_time[i] = 0;
+	}
+}
+
+void Simulator::endPhase(StepPhase phase, Clock::time_point& start)
+{
+	if (!profiling)
+	{
+		return;
+	}
+
+	Clock::time_point now = Clock::now();
+	double elapsed = std::chrono::duration<double>(now - start).count();
+	stats.phase_time[phase] += elapsed;
+	phase_time[phase] += elapsed;
+	start = now;
+}
+
+void Simulator::recordStep()
+{
+	stats.step = step;
+	stats.time = time;
+	stats.dt = timestep;
+	stats.particles = point_cloud->size;
+	stats.active_nodes = (int)grid->active_nodes.size();
+	stats.blocks = grid->block_count;
+	stats.implicit_iterations = grid->implicit_solve ? grid->implicit_iterations : 0;
+	for (int p = 0; p < PHASE_COUNT; p++)
+	{
+		stats.total_time += stats.phase_time[p];
+	}
+
+	if (trace != NULL)
+	{
+		trace->write(stats);
+	}
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #define SIMULATOR_H
 
 #include <stdlib.h>
+#include <chrono>
 
 #include "PointCloud.h"
 #include "Grid.h"
@@ -12,18 +13,76 @@
 #include "SimulationParameters.h"
 #include "Entity.h"
 #include "Scene.h"
+#include "ThreadPool.h"
+#include "StepStats.h"
+#include "Checkpoint.h"
+#include "SimulationConfig.h"
+#include "FrameExport.h"
 
 class Simulator
 {
 public:
 	Grid* grid;
 	PointCloud* point_cloud;
+	ThreadPool* thread_pool;
 
-	Simulator(Scene* scene);
-	Simulator(const Simulator& orig);
+	// Steps taken so far, and the simulated time they cover
+	int step;
+	double time;
+
+	// Settings of the run; the step settings (timesteps, gravity, sort_interval) may change between steps,
+	// the grid and material ones are taken by Grid and ParticleArrays at construction
+	SimulationConfig config;
+
+	// Length of the last step
+	double timestep;
+
+	// Step profiling; when off, update() reads no clocks
+	bool profiling;
+	// Statistics of the last step, and wall time spent in each phase since construction
+	// (or the last resetPhaseTimes), in seconds; only kept while profiling
+	StepStats stats;
+	double phase_time[PHASE_COUNT];
+	// Optional per-step record of stats; not owned
+	StepTrace* trace;
+
+	// Optional periodic checkpoints, every checkpoint_interval steps; not owned
+	CheckpointWriter* checkpoints;
+	int checkpoint_interval;
+
+	// Optional particle frame output, every export_interval steps; not owned
+	FrameExporter* exporter;
+	int export_interval;
+
+	// Fill the scene's shapes with particles, with the scene's settings
+	Simulator(Scene* scene, int workers = WORKER_THREADS);
+	Simulator(const SimulationConfig& config, std::vector<Entity*>& snow_entities, int workers = WORKER_THREADS);
+	// Continue from an existing state (see Checkpoint::load); takes ownership of cloud and grid
+	Simulator(const SimulationConfig& config, PointCloud* cloud, Grid* grid, int workers = WORKER_THREADS);
+	// Owns its grid, particles and workers, so it cannot be copied
+	Simulator(const Simulator&) = delete;
+	Simulator& operator=(const Simulator&) = delete;
 	virtual ~Simulator();
 
 	void update();
+
+	// Largest stable step for the current particle state:
+	// particles may cross cfl_number cells and, without the implicit solve, elastic waves elastic_cfl cells,
+	// up to max_timestep
+	double computeTimestep() const;
+
+	void resetPhaseTimes();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	// Workers and run settings shared by the constructors
+	void initialize(int workers);
+
+	// Add the time since start to a phase, and restart the clock
+	void endPhase(StepPhase phase, Clock::time_point& start);
+	// Fill in the rest of stats and pass them on to the trace
+	void recordStep();
 };
 
 #endif // !SIMULATOR_H
@@ -0,0 +1,102 @@
+#include "StepStats.h"
+
+#include <string.h>
+
+StepStats::StepStats() :
+	step(0), time(0), dt(0),
+	particles(0), active_nodes(0), blocks(0), implicit_iterations(0),
+	total_time(0)
+{
+	for (int i = 0; i < PHASE_COUNT; i++)
+	{
+		phase_time[i] = 0;
+	}
+}
+
+double StepStats::nsPerParticle() const
+{
+	return particles > 0 ? total_time * 1e9 / particles : 0;
+}
+
+const char* StepStats::phaseName(int phase)
+{
+	static const char* names[PHASE_COUNT] = { "sort", "p2g", "grid", "implicit", "g2p", "particles" };
+	return phase >= 0 && phase < PHASE_COUNT ? names[phase] : "unknown";
+}
+
+
+StepTrace::StepTrace(const char* path) : records(0)
+{
+	size_t length = strlen(path);
+	format = length >= 5 && strcmp(path + length - 5, ".json") == 0 ? JSON : CSV;
+
+	file = fopen(path, "w");
+	if (file == NULL)
+	{
+		return;
+	}
+
+	if (format == JSON)
+	{
+		fprintf(file, "[");
+		return;
+	}
+
+	fprintf(file, "step,time,dt,particles,active_nodes,blocks,implicit_iterations");
+	for (int p = 0; p < PHASE_COUNT; p++)
+	{
+		fprintf(file, ",%s_s", StepStats::phaseName(p));
+	}
+	fprintf(file, ",total_s,ns_per_particle\n");
+}
+
+StepTrace::~StepTrace()
+{
+	close();
+}
+
+void StepTrace::write(const StepStats& s)
+{
+	if (file == NULL)
+	{
+		return;
+	}
+
+	if (format == CSV)
+	{
+		fprintf(file, "%d,%.9g,%.9g,%d,%d,%d,%d",
+			s.step, s.time, s.dt, s.particles, s.active_nodes, s.blocks, s.implicit_iterations);
+		for (int p = 0; p < PHASE_COUNT; p++)
+		{
+			fprintf(file, ",%.9g", s.phase_time[p]);
+		}
+		fprintf(file, ",%.9g,%.6g\n", s.total_time, s.nsPerParticle());
+	}
+	else
+	{
+		fprintf(file, "%s\n {\"step\": %d, \"time\": %.9g, \"dt\": %.9g, \"particles\": %d, \"active_nodes\": %d, "
+			"\"blocks\": %d, \"implicit_iterations\": %d, \"phases\": {",
+			records > 0 ? "," : "", s.step, s.time, s.dt, s.particles, s.active_nodes, s.blocks, s.implicit_iterations);
+		for (int p = 0; p < PHASE_COUNT; p++)
+		{
+			fprintf(file, "%s\"%s\": %.9g", p > 0 ? ", " : "", StepStats::phaseName(p), s.phase_time[p]);
+		}
+		fprintf(file, "}, \"total\": %.9g, \"ns_per_particle\": %.6g}", s.total_time, s.nsPerParticle());
+	}
+	records++;
+}
+
+void StepTrace::close()
+{
+	if (file == NULL)
+	{
+		return;
+	}
+
+	if (format == JSON)
+	{
+		fprintf(file, "\n]\n");
+	}
+	fclose(file);
+	file = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+#ifndef STEPSTATS_H
+#define STEPSTATS_H
+
+#include <stdio.h>
+
+// Parts of a simulation step, for wall time accounting
+enum StepPhase
+{
+	PHASE_SORT,			// Morton reordering of the particles and timestep selection
+	PHASE_TO_GRID,		// Particle-to-grid transfer
+	PHASE_GRID,			// Explicit grid velocity update
+	PHASE_IMPLICIT,		// Semi-implicit solve
+	PHASE_TO_PARTICLES,	// Grid-to-particle transfer
+	PHASE_PARTICLES,	// Particle advection and plasticity
+	PHASE_COUNT
+};
+
+// What one step cost, recorded by Simulator::update while profiling
+struct StepStats
+{
+	int step;
+	double time, dt;
+
+	// Problem size this step
+	int particles, active_nodes, blocks, implicit_iterations;
+
+	// Wall time of each phase and of the whole step, in seconds
+	double phase_time[PHASE_COUNT];
+	double total_time;
+
+	StepStats();
+
+	// Step wall time per particle, in nanoseconds; comparable across scene sizes
+	double nsPerParticle() const;
+
+	static const char* phaseName(int phase);
+};
+
+// Writes one record per step to a CSV or JSON file
+class StepTrace
+{
+public:
+	enum Format
+	{
+		CSV,
+		JSON
+	};
+
+	// The format follows the extension: .json writes an array of objects, anything else CSV
+	StepTrace(const char* path);
+	// Owns its file, so it cannot be copied
+	StepTrace(const StepTrace&) = delete;
+	StepTrace& operator=(const StepTrace&) = delete;
+	virtual ~StepTrace();
+
+	// False if the file could not be created
+	bool isOpen() const { return file != NULL; }
+
+	void write(const StepStats& stats);
+
+	// Finish the file (closes the JSON array); also done by the destructor
+	void close();
+
+private:
+	FILE* file;
+	Format format;
+	int records;
+};
+
+#endif // !STEPSTATS_H
\ No newline at end of file
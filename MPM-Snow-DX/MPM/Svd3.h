@@ -0,0 +1,174 @@
+#pragma once
+#ifndef SVD3_H
+#define SVD3_H
+
+#include "Lanes.h"
+
+// Batched 3x3 singular value decomposition, A = U diag(sigma) V^T
+// After McAdams et al. 2011, "Computing the Singular Value Decomposition of 3x3 matrices
+// with minimal branching and elementary floating point operations":
+// a fixed number of Jacobi sweeps on A^T A with approximate Givens rotations gives V,
+// then a Givens QR of A V gives U and sigma
+// U and V are rotations; sigma is sorted by magnitude and only sigma[2] can be negative (inverted A)
+// Matrices are indexed [row][column], one lane per matrix
+template <typename T, int N>
+struct Svd3
+{
+	typedef Lanes<T, N> Vec;
+
+	// Jacobi sweeps; six reach round-off in single precision, but double needs a seventh when
+	// two singular values are close (see Tests/SvdAccuracy.cpp)
+	static const int SWEEPS = sizeof(T) > 4 ? 7 : 6;
+
+	static T epsilon()
+	{
+		return sizeof(T) > 4 ? (T)1e-15 : (T)1e-6;
+	}
+
+	static void compute(const Vec a[3][3], Vec u[3][3], Vec sigma[3], Vec v[3][3])
+	{
+		// Symmetric eigenproblem A^T A = V S V^T
+		Vec s[3][3];
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				s[i][j] = a[0][i] * a[0][j] + a[1][i] * a[1][j] + a[2][i] * a[2][j];
+				v[i][j] = (T)(i == j ? 1 : 0);
+			}
+		}
+
+		for (int sweep = 0; sweep < SWEEPS; sweep++)
+		{
+			jacobi(s, v, 0, 1);
+			jacobi(s, v, 0, 2);
+			jacobi(s, v, 1, 2);
+		}
+
+		// B = A V, with columns sorted by decreasing norm
+		Vec b[3][3];
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				b[i][j] = a[i][0] * v[0][j] + a[i][1] * v[1][j] + a[i][2] * v[2][j];
+			}
+		}
+
+		Vec rho[3];
+		for (int j = 0; j < 3; j++)
+		{
+			rho[j] = b[0][j] * b[0][j] + b[1][j] * b[1][j] + b[2][j] * b[2][j];
+		}
+		sortColumns(b, v, rho, 0, 1);
+		sortColumns(b, v, rho, 0, 2);
+		sortColumns(b, v, rho, 1, 2);
+
+		// QR decomposition B = U R; R is diagonal up to round-off
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				u[i][j] = (T)(i == j ? 1 : 0);
+			}
+		}
+		qr(b, u, 0, 1);
+		qr(b, u, 0, 2);
+		qr(b, u, 1, 2);
+
+		for (int i = 0; i < 3; i++)
+		{
+			sigma[i] = b[i][i];
+		}
+	}
+
+private:
+	// Rotate columns p and q of m by the angle with cosine c and sine sn
+	static void rotateColumns(Vec m[3][3], const Vec& c, const Vec& sn, int p, int q)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			Vec mp = m[k][p], mq = m[k][q];
+			m[k][p] = c * mp + sn * mq;
+			m[k][q] = c * mq - sn * mp;
+		}
+	}
+	static void rotateRows(Vec m[3][3], const Vec& c, const Vec& sn, int p, int q)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			Vec mp = m[p][k], mq = m[q][k];
+			m[p][k] = c * mp + sn * mq;
+			m[q][k] = c * mq - sn * mp;
+		}
+	}
+
+	// One Jacobi conjugation S = Q^T S Q, V = V Q, reducing s[p][q]
+	// The approximate Givens half angle falls back to pi/8 where the approximation is poor
+	static void jacobi(Vec s[3][3], Vec v[3][3], int p, int q)
+	{
+		const T gamma = (T)5.82842712474619, // 3 + 2 sqrt(2)
+			cstar = (T)0.923879532511287,	// cos(pi/8)
+			sstar = (T)0.38268343236509;	// sin(pi/8)
+
+		Vec ch = 2 * (s[p][p] - s[q][q]),
+			sh = s[p][q];
+		Vec ch2 = ch * ch, sh2 = sh * sh;
+		Vec w = rsqrt(ch2 + sh2);
+		ch = selectLess(gamma * sh2, ch2, w * ch, cstar);
+		sh = selectLess(gamma * sh2, ch2, w * sh, sstar);
+
+		Vec c = ch * ch - sh * sh,
+			sn = 2 * sh * ch;
+		rotateColumns(s, c, sn, p, q);
+		rotateRows(s, c, sn, p, q);
+		rotateColumns(v, c, sn, p, q);
+	}
+
+	// Swap columns p and q of B and V where column q is longer, negating one to keep V a rotation
+	static void sortColumns(Vec b[3][3], Vec v[3][3], Vec rho[3], int p, int q)
+	{
+		Vec swap_p, swap_q;
+		for (int k = 0; k < 3; k++)
+		{
+			swap_p = selectLess(rho[p], rho[q], b[k][q], b[k][p]);
+			swap_q = selectLess(rho[p], rho[q], -b[k][p], b[k][q]);
+			b[k][p] = swap_p;
+			b[k][q] = swap_q;
+
+			swap_p = selectLess(rho[p], rho[q], v[k][q], v[k][p]);
+			swap_q = selectLess(rho[p], rho[q], -v[k][p], v[k][q]);
+			v[k][p] = swap_p;
+			v[k][q] = swap_q;
+		}
+		swap_p = selectLess(rho[p], rho[q], rho[q], rho[p]);
+		swap_q = selectLess(rho[p], rho[q], rho[p], rho[q]);
+		rho[p] = swap_p;
+		rho[q] = swap_q;
+	}
+
+	// Givens rotation zeroing b[q][p]; U accumulates the transposed rotations
+	static void qr(Vec b[3][3], Vec u[3][3], int p, int q)
+	{
+		const Vec eps = epsilon();
+		Vec a1 = b[p][p], a2 = b[q][p];
+
+		Vec rho = sqrt(a1 * a1 + a2 * a2);
+		Vec sh = selectLess(eps, rho, a2, (T)0),
+			ch = abs(a1) + max(rho, eps);
+		// Negative pivots swap the half angle components, so the pivot turns out positive
+		Vec swap = ch;
+		ch = selectLess(a1, (T)0, sh, ch);
+		sh = selectLess(a1, (T)0, swap, sh);
+		Vec w = rsqrt(ch * ch + sh * sh);
+		ch *= w;
+		sh *= w;
+
+		Vec c = ch * ch - sh * sh,
+			sn = 2 * sh * ch;
+		rotateRows(b, c, sn, p, q);
+		rotateColumns(u, c, sn, p, q);
+	}
+};
+
+#endif // !SVD3_H
\ No newline at end of file
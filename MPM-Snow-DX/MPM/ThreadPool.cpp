@@ -0,0 +1,116 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int workers) :
+	generation(0),
+	busy_workers(0),
+	stopping(false),
+	job(nullptr),
+	job_count(0),
+	job_grain(1),
+	next_index(0)
+{
+	if (workers <= 0)
+	{
+		workers = std::thread::hardware_concurrency();
+	}
+	num_workers = workers > 0 ? workers : 1;
+
+	// The calling thread is the first worker
+	for (int i = 1; i < num_workers; i++)
+	{
+		threads.push_back(std::thread(&ThreadPool::workerLoop, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	start_signal.notify_all();
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int, int)>& func, int grain)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	// Default to a few chunks per worker, so uneven chunks still balance out
+	if (grain <= 0)
+	{
+		grain = count / (num_workers * 8);
+		if (grain < 1) grain = 1;
+	}
+
+	if (num_workers == 1 || count <= grain)
+	{
+		func(0, count);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &func;
+		job_count = count;
+		job_grain = grain;
+		next_index = 0;
+		busy_workers = (int)threads.size();
+		generation++;
+	}
+	start_signal.notify_all();
+
+	runChunks();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done_signal.wait(lock, [this] { return busy_workers == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::workerLoop()
+{
+	unsigned int seen = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_signal.wait(lock, [this, seen] { return stopping || generation != seen; });
+			if (stopping)
+			{
+				return;
+			}
+			seen = generation;
+		}
+
+		runChunks();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy_workers--;
+		}
+		done_signal.notify_one();
+	}
+}
+
+// Grab chunks until the index range is exhausted
+void ThreadPool::runChunks()
+{
+	while (true)
+	{
+		int begin = next_index.fetch_add(job_grain);
+		if (begin >= job_count)
+		{
+			return;
+		}
+		int end = begin + job_grain < job_count ? begin + job_grain : job_count;
+		(*job)(begin, end);
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Persistent worker threads for data-parallel loops
+// The calling thread takes part in every loop, so a pool of one worker runs everything inline
+class ThreadPool
+{
+public:
+	// Zero workers means one worker per hardware thread
+	ThreadPool(int workers = 0);
+	// Owns its worker threads, so it cannot be copied
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	virtual ~ThreadPool();
+
+	int size() const { return num_workers; }
+
+	// Split [0, count) into chunks and call func(begin, end) for each chunk across all workers
+	// Blocks until every chunk is done
+	void parallelFor(int count, const std::function<void(int, int)>& func, int grain = 0);
+
+private:
+	int num_workers;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable start_signal, done_signal;
+	unsigned int generation;
+	int busy_workers;
+	bool stopping;
+
+	// Current job
+	const std::function<void(int, int)>* job;
+	int job_count, job_grain;
+	std::atomic<int> next_index;
+
+	void workerLoop();
+	void runChunks();
+};
+
+#endif // !THREADPOOL_H
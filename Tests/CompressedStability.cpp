@@ -0,0 +1,61 @@
+// Stability test of the adaptive timestep on compacted snow
+// A block whose plastic compression hardens it well beyond the fresh material is released with some
+// elastic compression; the explicit solver must keep it bounded, which only holds when the elastic
+// CFL limit sees the hardened wave speed
+// Exits nonzero when the block blows up
+#include <stdio.h>
+#include <math.h>
+
+#include "Simulator.h"
+
+int main()
+{
+	const int steps = 300;
+	// Jp of 0.5 with the default hardening stiffens the snow e^5 times
+	const Real plastic_det = (Real)0.5;
+	const double max_speed = 50;
+
+	SimulationConfig config;
+	config.implicit_solve = false;
+	config.adaptive_timestep = true;
+	// Wide elastic limits, so plastic flow does not damp an unstable step
+	config.materials[0].crit_compress = 0.8;
+	config.materials[0].crit_stretch = 1.2;
+	std::vector<Entity*> entities;
+	entities.push_back(Entity::generateSnowcube(Eigen::Vector3d(1, 0.2, 0.5), 0.08, Eigen::Vector3d::Zero()));
+
+	Simulator simulator(config, entities, 1);
+	delete entities[0];
+	if (simulator.point_cloud == NULL)
+	{
+		printf("compressed stability: no particles\n");
+		return 1;
+	}
+
+	ParticleArrays& p = simulator.point_cloud->particles;
+	Matrix3r compressed = Matrix3r::Identity() * (Real)0.99,
+		fp = Matrix3r::Identity() * (Real)cbrt((double)plastic_det);
+	for (int i = 0; i < p.size(); i++)
+	{
+		p.plastic_det[i] = plastic_det;
+		p.def_plastic[i] = fp;
+		p.def_elastic[i] = compressed;
+	}
+	simulator.point_cloud->measureSpeeds();
+
+	double largest_dt = 0, smallest_dt = 1;
+	bool ok = true;
+	int s = 0;
+	for (; s < steps && ok; s++)
+	{
+		simulator.update();
+		largest_dt = std::max(largest_dt, simulator.timestep);
+		smallest_dt = std::min(smallest_dt, simulator.timestep);
+		ok = sqrt(simulator.point_cloud->max_velocity) < max_speed && simulator.grid->stray_particles == 0;
+	}
+
+	printf("%d particles, %d steps, dt %.3g to %.3g s, max speed %.3g m/s, %lld strays\n",
+		p.size(), s, smallest_dt, largest_dt, sqrt(simulator.point_cloud->max_velocity), simulator.grid->stray_particles);
+	printf(ok ? "compressed stability: passed\n" : "compressed stability: FAILED\n");
+	return ok ? 0 : 1;
+}
\ No newline at end of file
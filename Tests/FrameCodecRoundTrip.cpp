@@ -0,0 +1,249 @@
+// Round trip test of the compressed frame stream (FrameCodec)
+// Encodes synthetic frames at several position precisions, decodes them and checks each field against
+// its quantisation bound; then decodes out of order through the index, and reopens the stream with its
+// index cut off, or cut inside a frame, which must be rescanned up to the last complete frame
+// Exits nonzero when any check fails
+#include <stdio.h>
+#include <math.h>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "FrameCodec.h"
+
+// One frame of float fields, as the exporter writes them
+struct Fields
+{
+	int step;
+	std::vector<float> position, velocity, density, volume;
+};
+
+static const double origin[3] = { -0.5, 0, 0.25 }, extent[3] = { 2, 1, 1 };
+
+// Particles drift smoothly with some jitter, so every predictor gets used; the count drops partway
+static std::vector<Fields> generate(int frames, int particles)
+{
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<double> unit(0, 1), jitter(-1e-4, 1e-4);
+	std::vector<double> start(3 * particles), drift(3 * particles);
+	for (int i = 0; i < 3 * particles; i++)
+	{
+		int d = i % 3;
+		start[i] = origin[d] + extent[d] * (0.1 + 0.8 * unit(rng));
+		drift[i] = 2e-3 * (unit(rng) - 0.5);
+	}
+
+	std::vector<Fields> out(frames);
+	for (int f = 0; f < frames; f++)
+	{
+		int n = f < frames * 3 / 4 ? particles : particles - 301;
+		Fields& fields = out[f];
+		fields.step = 20 * f;
+		fields.position.resize(3 * n);
+		fields.velocity.resize(3 * n);
+		fields.density.resize(n);
+		fields.volume.resize(n);
+		for (int i = 0; i < 3 * n; i++)
+		{
+			fields.position[i] = (float)(start[i] + f * drift[i] + jitter(rng));
+			fields.velocity[i] = (float)(drift[i] * 1e3 + jitter(rng) * 1e3);
+		}
+		for (int i = 0; i < n; i++)
+		{
+			fields.density[i] = (float)(400 + 50 * sin(0.1 * f + i));
+			fields.volume[i] = (float)(1.25e-7 * (1 + 0.1 * cos(0.05 * f + i)));
+		}
+	}
+	return out;
+}
+
+static bool encode(const char* path, const FrameCodecSettings& settings, const std::vector<Fields>& frames)
+{
+	FrameEncoder encoder(path, settings, origin, extent);
+	bool ok = encoder.isOpen();
+	for (size_t f = 0; f < frames.size() && ok; f++)
+	{
+		const Fields& fields = frames[f];
+		ok = encoder.encode(fields.step, fields.step * 1e-4, (int)fields.density.size(),
+			fields.position.data(), fields.velocity.data(), fields.density.data(), fields.volume.data());
+	}
+	return encoder.close() && ok;
+}
+
+// Largest error of one field, in units of its bound: half a quantisation step plus the float rounding of the result
+static double worst(const std::vector<float>& found, const std::vector<float>& expected, double half_step)
+{
+	double w = 0;
+	for (size_t i = 0; i < expected.size(); i++)
+	{
+		double bound = half_step + fabs(nextafterf(expected[i], INFINITY) - expected[i]);
+		w = std::max(w, fabs((double)found[i] - expected[i]) / bound);
+	}
+	return w;
+}
+
+static bool decodeFrame(FrameDecoder& decoder, int f, Fields& out)
+{
+	return decoder.decode(f, out.position, out.velocity, out.density, out.volume);
+}
+
+static bool same(const Fields& a, const Fields& b)
+{
+	return a.position == b.position && a.velocity == b.velocity && a.density == b.density && a.volume == b.volume;
+}
+
+static bool copyPrefix(const char* from, const char* to, long bytes)
+{
+	FILE* in = fopen(from, "rb");
+	FILE* out = fopen(to, "wb");
+	bool ok = in != NULL && out != NULL;
+	std::vector<char> data(bytes > 0 ? bytes : 0);
+	ok = ok && fread(data.data(), 1, data.size(), in) == data.size() && fwrite(data.data(), 1, data.size(), out) == data.size();
+	if (in != NULL) fclose(in);
+	if (out != NULL) ok = fclose(out) == 0 && ok;
+	return ok;
+}
+
+static long fileLength(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return -1;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fclose(file);
+	return length;
+}
+
+static bool check(bool condition, const char* what, bool& ok)
+{
+	printf("  %-52s %s\n", what, condition ? "ok" : "FAILED");
+	ok = ok && condition;
+	return condition;
+}
+
+int main()
+{
+	const int frame_count = 40, particles = 3000;
+	const char* path = "frame-codec-test.mpmz";
+	const char* cut_path = "frame-codec-test-cut.mpmz";
+	std::vector<Fields> frames = generate(frame_count, particles);
+	bool ok = true;
+
+	const int bit_counts[] = { 8, 16, 21, FRAME_MAX_POSITION_BITS };
+	for (int b = 0; b < 4; b++)
+	{
+		FrameCodecSettings settings;
+		settings.position_bits = bit_counts[b];
+		settings.key_interval = 8;
+		settings.volume_step = 1.25e-11;
+		printf("%d position bits\n", settings.position_bits);
+
+		if (!check(encode(path, settings, frames), "encode", ok))
+		{
+			continue;
+		}
+
+		// In order: every field within half a step of its quantisation
+		FrameDecoder decoder(path);
+		check(decoder.isOpen() && decoder.header.position_bits == settings.position_bits
+			&& decoder.frameCount() == frame_count, "open with the configured precision and every frame", ok);
+		double limit = (double)((1ull << settings.position_bits) - 1);
+		double position_error = 0, velocity_error = 0, density_error = 0, volume_error = 0;
+		std::vector<Fields> decoded(frame_count);
+		bool all = decoder.isOpen() && decoder.frameCount() == frame_count;
+		for (int f = 0; f < frame_count && all; f++)
+		{
+			all = decodeFrame(decoder, f, decoded[f]) && decoded[f].density.size() == frames[f].density.size()
+				&& decoder.entry(f).step == frames[f].step;
+			if (!all)
+			{
+				break;
+			}
+			// Positions are quantised per axis
+			for (int d = 0; d < 3; d++)
+			{
+				std::vector<float> found, expected;
+				for (size_t i = d; i < frames[f].position.size(); i += 3)
+				{
+					found.push_back(decoded[f].position[i]);
+					expected.push_back(frames[f].position[i]);
+				}
+				position_error = std::max(position_error, worst(found, expected, 0.5 * extent[d] / limit));
+			}
+			velocity_error = std::max(velocity_error, worst(decoded[f].velocity, frames[f].velocity, 0.5 * settings.velocity_step));
+			density_error = std::max(density_error, worst(decoded[f].density, frames[f].density, 0.5 * settings.density_step));
+			volume_error = std::max(volume_error, worst(decoded[f].volume, frames[f].volume, 0.5 * settings.volume_step));
+		}
+		check(all, "decode every frame in order", ok);
+		printf("  errors relative to their bounds: position %.3f, velocity %.3f, density %.3f, volume %.3f\n",
+			position_error, velocity_error, density_error, volume_error);
+		check(all && position_error <= 1 && velocity_error <= 1 && density_error <= 1 && volume_error <= 1,
+			"every field within its quantisation bound", ok);
+		if (!all)
+		{
+			continue;
+		}
+
+		// Out of order through the index: backwards, and shuffled, must match the in-order frames exactly
+		bool match = true;
+		Fields fields;
+		for (int f = frame_count - 1; f >= 0 && match; f--)
+		{
+			match = decodeFrame(decoder, f, fields) && same(fields, decoded[f]);
+		}
+		std::vector<int> order(frame_count);
+		for (int f = 0; f < frame_count; f++)
+		{
+			order[f] = f;
+		}
+		std::shuffle(order.begin(), order.end(), std::mt19937(11));
+		for (int k = 0; k < frame_count && match; k++)
+		{
+			match = decodeFrame(decoder, order[k], fields) && same(fields, decoded[order[k]]);
+		}
+		check(match, "decode out of order through the index", ok);
+		check(!decodeFrame(decoder, frame_count, fields) && !decodeFrame(decoder, -1, fields),
+			"reject frames past either end", ok);
+
+		// Index cut off: rebuilt by scanning the records, same frames
+		long length = fileLength(path);
+		long index_bytes = (long)(frame_count * sizeof(FrameIndexEntry) + sizeof(FrameIndexTrailer));
+		bool rescanned = copyPrefix(path, cut_path, length - index_bytes / 2);
+		{
+			FrameDecoder cut(cut_path);
+			rescanned = rescanned && cut.isOpen() && cut.frameCount() == frame_count;
+			for (int f = frame_count - 1; f >= 0 && rescanned; f -= 3)
+			{
+				rescanned = decodeFrame(cut, f, fields) && same(fields, decoded[f]);
+			}
+		}
+		check(rescanned, "rescan a stream with its index cut off", ok);
+
+		// Cut inside the last frame: every earlier frame survives, the partial one is dropped
+		bool partial = copyPrefix(path, cut_path, length - index_bytes - 100);
+		{
+			FrameDecoder cut(cut_path);
+			partial = partial && cut.isOpen() && cut.frameCount() == frame_count - 1
+				&& decodeFrame(cut, frame_count - 2, fields) && same(fields, decoded[frame_count - 2])
+				&& !decodeFrame(cut, frame_count - 1, fields);
+		}
+		check(partial, "drop a frame cut short", ok);
+
+		// Header cut short: rejected
+		bool rejected = copyPrefix(path, cut_path, (long)sizeof(FrameStreamHeader) - 8);
+		{
+			FrameDecoder cut(cut_path);
+			rejected = rejected && !cut.isOpen() && !decodeFrame(cut, 0, fields);
+		}
+		check(rejected, "reject a stream with its header cut short", ok);
+	}
+
+	remove(path);
+	remove(cut_path);
+	printf(ok ? "frame codec round trip: passed\n" : "frame codec round trip: FAILED\n");
+	return ok ? 0 : 1;
+}
\ No newline at end of file
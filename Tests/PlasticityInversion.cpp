@@ -0,0 +1,74 @@
+// Plasticity test on inverted elastic gradients
+// Svd3 returns a negative last singular value for det(Fe) < 0; the clamp must still keep Jp positive,
+// leave Fe inverted, conserve Fe Fp, and keep the hardened stress finite
+// Exits nonzero when any check fails
+#include <stdio.h>
+#include <math.h>
+#include <random>
+
+#include <Eigen/Dense>
+#include "ParticleArrays.h"
+
+static Eigen::Matrix3d randomRotation(std::mt19937& rng)
+{
+	std::normal_distribution<double> normal;
+	Eigen::Quaterniond q(normal(rng), normal(rng), normal(rng), normal(rng));
+	return q.normalized().toRotationMatrix();
+}
+
+int main()
+{
+	const int count = 4000;
+	const double tolerance = sizeof(Real) > 4 ? 1e-9 : 1e-3;
+
+	ParticleArrays p;
+	p.reserve(count);
+	std::mt19937 rng(7);
+	// Stretches inside and well outside the default elastic region
+	std::uniform_real_distribution<double> stretch(0.5, 1.5);
+	AlignedVector<Matrix3r> total(count);
+	for (int i = 0; i < count; i++)
+	{
+		p.push_back(Particle(Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero(), 1));
+		p.volume[i] = 1;
+
+		// Every other particle is inverted through a different axis
+		Eigen::Vector3d s(stretch(rng), stretch(rng), stretch(rng));
+		if (i % 2 == 0)
+		{
+			s((i / 2) % 3) = -s((i / 2) % 3);
+		}
+		Eigen::Matrix3d fe = randomRotation(rng) * s.asDiagonal() * randomRotation(rng).transpose();
+		p.def_elastic[i] = fe.cast<Real>();
+		total[i] = p.def_elastic[i] * p.def_plastic[i];
+	}
+
+	p.applyPlasticity(0, count);
+
+	int failures = 0;
+	double max_product = 0, max_jp = 0;
+	for (int i = 0; i < count; i++)
+	{
+		double jp = p.plastic_det[i],
+			   det_fe = p.def_elastic[i].cast<double>().determinant(),
+			   det_fp = p.def_plastic[i].cast<double>().determinant();
+		bool inverted = i % 2 == 0;
+		double product = (p.def_elastic[i] * p.def_plastic[i] - total[i]).cast<double>().cwiseAbs().maxCoeff();
+		max_product = std::max(max_product, product);
+		max_jp = std::max(max_jp, jp);
+
+		bool ok = jp > 0 && det_fp > 0 && (det_fe < 0) == inverted
+			&& fabs(det_fp - jp) <= 1e3 * tolerance * jp
+			&& product <= tolerance && p.stress[i].allFinite();
+		if (!ok && failures++ < 5)
+		{
+			printf("particle %d%s: Jp %.6g, det Fp %.6g, det Fe %.6g, |Fe Fp - F| %.3g\n",
+				i, inverted ? " (inverted)" : "", jp, det_fp, det_fe, product);
+		}
+	}
+
+	printf("%s precision: %d particles, largest Jp %.4g, largest |Fe Fp - F| %.3g, %d failed\n",
+		sizeof(Real) > 4 ? "double" : "single", count, max_jp, max_product, failures);
+	printf(failures == 0 ? "plasticity inversion: passed\n" : "plasticity inversion: FAILED\n");
+	return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,181 @@
+// Accuracy test of the batched SVD (Svd3) against Eigen's JacobiSVD, in single and double precision
+// Checks singular values, reconstruction and that U and V are rotations on random deformation gradients
+// and the awkward cases: inversions, repeated and near-zero singular values, pure rotations
+// Exits nonzero when any check exceeds its tolerance
+#include <stdio.h>
+#include <math.h>
+#include <random>
+#include <algorithm>
+
+#include <Eigen/Dense>
+#include "Svd3.h"
+
+// Tolerances, relative to the largest singular value
+struct Tolerance
+{
+	double sigma, residual, orthogonality;
+};
+
+// A matrix family: fills a with one sample
+typedef void (*Generator)(std::mt19937& rng, Eigen::Matrix3d& a);
+
+static Eigen::Matrix3d randomRotation(std::mt19937& rng)
+{
+	std::normal_distribution<double> normal;
+	Eigen::Quaterniond q(normal(rng), normal(rng), normal(rng), normal(rng));
+	return q.normalized().toRotationMatrix();
+}
+
+static void nearIdentity(std::mt19937& rng, Eigen::Matrix3d& a)
+{
+	std::uniform_real_distribution<double> entry(-0.3, 0.3);
+	a = Eigen::Matrix3d::Identity();
+	for (int r = 0; r < 3; r++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			a(r, c) += entry(rng);
+		}
+	}
+}
+
+static void randomEntries(std::mt19937& rng, Eigen::Matrix3d& a)
+{
+	std::uniform_real_distribution<double> entry(-1, 1);
+	for (int r = 0; r < 3; r++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			a(r, c) = entry(rng);
+		}
+	}
+}
+
+// Rotated stretches around the plasticity limits, half of them inverted
+static void stretched(std::mt19937& rng, Eigen::Matrix3d& a)
+{
+	std::uniform_real_distribution<double> stretch(0.5, 1.5);
+	Eigen::Vector3d s(stretch(rng), stretch(rng), stretch(rng));
+	if (rng() & 1)
+	{
+		s(2) = -s(2);
+	}
+	a = randomRotation(rng) * s.asDiagonal() * randomRotation(rng).transpose();
+}
+
+static void repeated(std::mt19937& rng, Eigen::Matrix3d& a)
+{
+	static const Eigen::Vector3d cases[4] = {
+		Eigen::Vector3d(1, 1, 1), Eigen::Vector3d(2, 2, 0.5), Eigen::Vector3d(2, 0.5, 0.5), Eigen::Vector3d(1, 1, -1) };
+	a = randomRotation(rng) * cases[rng() % 4].asDiagonal() * randomRotation(rng).transpose();
+}
+
+static void nearSingular(std::mt19937& rng, Eigen::Matrix3d& a)
+{
+	std::uniform_real_distribution<double> stretch(0.5, 1.5);
+	Eigen::Vector3d s(stretch(rng), stretch(rng), (rng() & 1 ? 1e-4 : 0.0));
+	a = randomRotation(rng) * s.asDiagonal() * randomRotation(rng).transpose();
+}
+
+static void rotation(std::mt19937& rng, Eigen::Matrix3d& a)
+{
+	a = randomRotation(rng);
+}
+
+static const int FAMILIES = 6;
+static const char* family_names[FAMILIES] = { "near identity", "random", "stretched", "repeated", "near singular", "rotation" };
+static const Generator generators[FAMILIES] = { nearIdentity, randomEntries, stretched, repeated, nearSingular, rotation };
+
+// Largest deviation of m from a rotation: |m^T m - I| and |det m - 1|
+template <typename T>
+static double rotationError(const Eigen::Matrix<T, 3, 3>& m)
+{
+	Eigen::Matrix3d d = m.template cast<double>();
+	return std::max((d.transpose() * d - Eigen::Matrix3d::Identity()).cwiseAbs().maxCoeff(), fabs(d.determinant() - 1));
+}
+
+template <typename T, int N>
+static bool testPrecision(const char* name, const Tolerance& tolerance, int samples)
+{
+	typedef Svd3<T, N> Svd;
+	typedef Eigen::Matrix<T, 3, 3> Matrix;
+	bool ok = true;
+
+	for (int f = 0; f < FAMILIES; f++)
+	{
+		std::mt19937 rng(7 + f);
+		double max_sigma = 0, max_residual = 0, max_rotation = 0;
+
+		for (int batch = 0; batch < samples / N; batch++)
+		{
+			Matrix a[N];
+			typename Svd::Vec la[3][3], lu[3][3], ls[3], lv[3][3];
+			for (int l = 0; l < N; l++)
+			{
+				Eigen::Matrix3d sample;
+				generators[f](rng, sample);
+				a[l] = sample.cast<T>();
+				for (int r = 0; r < 3; r++)
+				{
+					for (int c = 0; c < 3; c++)
+					{
+						la[r][c][l] = a[l](r, c);
+					}
+				}
+			}
+
+			Svd::compute(la, lu, ls, lv);
+
+			for (int l = 0; l < N; l++)
+			{
+				Matrix u, v;
+				Eigen::Matrix<T, 3, 1> sigma;
+				for (int r = 0; r < 3; r++)
+				{
+					sigma(r) = ls[r][l];
+					for (int c = 0; c < 3; c++)
+					{
+						u(r, c) = lu[r][c][l];
+						v(r, c) = lv[r][c][l];
+					}
+				}
+
+				// Reference in double from the same (rounded) input
+				Eigen::Matrix3d input = a[l].template cast<double>();
+				Eigen::JacobiSVD<Eigen::Matrix3d> svd(input);
+				Eigen::Vector3d reference = svd.singularValues();
+				double scale = std::max(reference(0), 1e-30);
+
+				// Eigen keeps singular values non-negative and sorted; Svd3 moves a reflection into sigma[2]
+				Eigen::Vector3d found = sigma.template cast<double>().cwiseAbs();
+				std::sort(found.data(), found.data() + 3, [](double x, double y) { return x > y; });
+				max_sigma = std::max(max_sigma, (reference - found).cwiseAbs().maxCoeff() / scale);
+
+				Eigen::Matrix3d rebuilt = u.template cast<double>() * sigma.template cast<double>().asDiagonal()
+					* v.template cast<double>().transpose();
+				max_residual = std::max(max_residual, (rebuilt - input).cwiseAbs().maxCoeff() / scale);
+				max_rotation = std::max(max_rotation, std::max(rotationError(u), rotationError(v)));
+			}
+		}
+
+		bool passed = max_sigma <= tolerance.sigma && max_residual <= tolerance.residual
+			&& max_rotation <= tolerance.orthogonality;
+		printf("%-6s %-14s sigma %.3g, residual %.3g, rotation %.3g  %s\n",
+			name, family_names[f], max_sigma, max_residual, max_rotation, passed ? "ok" : "FAILED");
+		ok = ok && passed;
+	}
+	return ok;
+}
+
+int main()
+{
+	const int samples = 20000;
+	const Tolerance single_tolerance = { 2e-5, 2e-5, 2e-5 },
+		double_tolerance = { 1e-13, 1e-13, 1e-13 };
+
+	bool ok = testPrecision<float, 8>("float", single_tolerance, samples);
+	ok = testPrecision<double, 4>("double", double_tolerance, samples) && ok;
+
+	printf(ok ? "svd accuracy: passed\n" : "svd accuracy: FAILED\n");
+	return ok ? 0 : 1;
+}
\ No newline at end of file